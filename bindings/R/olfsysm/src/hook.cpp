@@ -80,6 +80,28 @@ extern "C" SEXP mk_runvars(SEXP mp_) { TRYFWD (
     Rcpp::XPtr<RunVars> rv(new RunVars(*mp), true);
     return Rcpp::wrap(rv);
 )}
+extern "C" SEXP mk_upstreamvars(SEXP mp_) { TRYFWD (
+    DEFFROM_AS(Rcpp::XPtr<ModelParams>, mp, mp_);
+    Rcpp::XPtr<UpstreamVars> uv(new UpstreamVars(*mp), true);
+    return Rcpp::wrap(uv);
+)}
+/* The new KCRunVars shares rv's upstream sims; R keeps rv alive for as long
+ * as it is around. */
+extern "C" SEXP mk_kcrunvars(SEXP mp_, SEXP rv_) { TRYFWD (
+    DEFFROM_AS(Rcpp::XPtr<ModelParams>, mp, mp_);
+    DEFFROM_AS(Rcpp::XPtr<RunVars>, rv, rv_);
+    std::shared_ptr<UpstreamVars const> up(rv.get(), [](UpstreamVars const*){});
+    Rcpp::XPtr<KCRunVars> kv(new KCRunVars(*mp, up), true, R_NilValue, rv_);
+    return Rcpp::wrap(kv);
+)}
+/* Same, on an UpstreamVars. */
+extern "C" SEXP mk_kcrunvars_uv(SEXP mp_, SEXP uv_) { TRYFWD (
+    DEFFROM_AS(Rcpp::XPtr<ModelParams>, mp, mp_);
+    DEFFROM_AS(Rcpp::XPtr<UpstreamVars>, uv, uv_);
+    std::shared_ptr<UpstreamVars const> up(uv.get(), [](UpstreamVars const*){});
+    Rcpp::XPtr<KCRunVars> kv(new KCRunVars(*mp, up), true, R_NilValue, uv_);
+    return Rcpp::wrap(kv);
+)}
 
 #ifdef ACCESS
     #error ACCESS macro already defined!
@@ -105,6 +127,9 @@ extern "C" SEXP access_mparam(
     ACCESS("time.stim.start",          mp->time.stim.start);
     ACCESS("time.stim.end",            mp->time.stim.end);
     ACCESS("time.dt",                  mp->time.dt);
+    ACCESS("time.integrator",          mp->time.integrator);
+    ACCESS("time.quiescence_tol",      mp->time.quiescence_tol);
+    ACCESS("time.solve_spont",         mp->time.solve_spont);
     ACCESS("orn.taum",                 mp->orn.taum);
     ACCESS("orn.n_physical_gloms",     mp->orn.n_physical_gloms);
     ACCESS("orn.data.spont",           mp->orn.data.spont);
@@ -120,8 +145,10 @@ extern "C" SEXP access_mparam(
     ACCESS("pn.tanhsc",                mp->pn.tanhsc);
     ACCESS("pn.inhsc",                 mp->pn.inhsc);
     ACCESS("pn.inhadd",                mp->pn.inhadd);
+    ACCESS("pn.transfer",              mp->pn.transfer);
     ACCESS("pn.noise.mean",            mp->pn.noise.mean);
     ACCESS("pn.noise.sd",              mp->pn.noise.sd);
+    ACCESS("pn.noise.seed",            mp->pn.noise.seed);
     ACCESS("ffapl.taum",               mp->ffapl.taum);
     ACCESS("ffapl.w",                  mp->ffapl.w);
     ACCESS("ffapl.coef",               mp->ffapl.coef);
@@ -138,15 +165,18 @@ extern "C" SEXP access_mparam(
     ACCESS("kc.preset_wPNKC",          mp->kc.preset_wPNKC);
     ACCESS("kc.seed",                  mp->kc.seed);
     ACCESS("kc.currents",              mp->kc.currents);
-    ACCESS("kc.enable_apl",            mp->kc.enable_apl);
+    ACCESS("kc.tune_apl_weights",      mp->kc.tune_apl_weights);
     ACCESS("kc.ignore_ffapl",          mp->kc.ignore_ffapl);
     ACCESS("kc.fixed_thr",             mp->kc.fixed_thr);
     ACCESS("kc.use_fixed_thr",         mp->kc.use_fixed_thr);
     ACCESS("kc.use_homeostatic_thrs",  mp->kc.use_homeostatic_thrs);
     ACCESS("kc.thr_type",              mp->kc.thr_type);
+    ACCESS("kc.streaming_thr",         mp->kc.streaming_thr);
     ACCESS("kc.sp_target",             mp->kc.sp_target);
     ACCESS("kc.sp_acc",                mp->kc.sp_acc);
+    ACCESS("kc.apl_tuner",             mp->kc.apl_tuner);
     ACCESS("kc.sp_lr_coeff",           mp->kc.sp_lr_coeff);
+    ACCESS("kc.warm_start",            mp->kc.warm_start);
     ACCESS("kc.max_iters",             mp->kc.max_iters);
     ACCESS("kc.tune_from",             mp->kc.tune_from);
     ACCESS("kc.apltune_subsample",     mp->kc.apltune_subsample);
@@ -155,6 +185,8 @@ extern "C" SEXP access_mparam(
     ACCESS("kc.tau_apl2kc",            mp->kc.tau_apl2kc);
     ACCESS("kc.tau_r",                 mp->kc.tau_r);
     ACCESS("kc.ves_p",                 mp->kc.ves_p);
+    ACCESS("kc.odor_batch",            mp->kc.odor_batch);
+    ACCESS("kc.single_precision",      mp->kc.single_precision);
     ACCESS("kc.save_vm_sims",          mp->kc.save_vm_sims);
     ACCESS("kc.save_spike_recordings", mp->kc.save_spike_recordings);
     ACCESS("kc.save_nves_sims",        mp->kc.save_nves_sims);
@@ -166,6 +198,39 @@ extern "C" SEXP access_mparam(
     return R_NilValue;
 )}
 
+/* Access a "kc." run variable, or return NULL if there is none by that
+ * name. */
+SEXP access_kcvar(RunVars::KC& kc, std::string const& name, SEXP val, bool set) {
+    ACCESS("kc.wPNKC",            kc.wPNKC);
+    ACCESS("kc.wAPLKC",           kc.wAPLKC);
+    ACCESS("kc.wKCAPL",           kc.wKCAPL);
+    ACCESS("kc.pks",              kc.pks);
+    ACCESS("kc.thr",              kc.thr);
+    ACCESS("kc.responses",        kc.responses);
+    ACCESS("kc.spike_counts",     kc.spike_counts);
+    ACCESS("kc.vm_sims",          kc.vm_sims);
+    ACCESS("kc.spike_recordings", kc.spike_recordings);
+    ACCESS("kc.nves_sims",        kc.nves_sims);
+    ACCESS("kc.inh_sims",         kc.inh_sims);
+    ACCESS("kc.Is_sims",          kc.Is_sims);
+    ACCESS("kc.tuning_iters",     kc.tuning_iters);
+    ACCESS("kc.tuning_w",         kc.tuning_w);
+    ACCESS("kc.tuning_sp",        kc.tuning_sp);
+    return NULL;
+}
+
+/* Access an upstream run variable, or return NULL if there is none by that
+ * name. */
+SEXP access_upvar(UpstreamVars& up, std::string const& name, SEXP val, bool set) {
+    ACCESS("orn.sims",            up.orn.sims);
+    ACCESS("ln.inhA.sims",        up.ln.inhA.sims);
+    ACCESS("ln.inhB.sims",        up.ln.inhB.sims);
+    ACCESS("pn.sims",             up.pn.sims);
+    ACCESS("ffapl.vm_sims",       up.ffapl.vm_sims);
+    ACCESS("ffapl.coef_sims",     up.ffapl.coef_sims);
+    return NULL;
+}
+
 extern "C" SEXP access_rvar(
         SEXP rv_,
         SEXP name_,
@@ -174,30 +239,45 @@ extern "C" SEXP access_rvar(
     DEFFROM_AS(std::string, name, name_);
     DEFFROM_AS(bool, set, set_);
 
-    ACCESS("orn.sims",            rv->orn.sims);
-    ACCESS("ln.inhA.sims",        rv->ln.inhA.sims);
-    ACCESS("ln.inhB.sims",        rv->ln.inhB.sims);
-    ACCESS("pn.sims",             rv->pn.sims);
-    ACCESS("ffapl.vm_sims",       rv->ffapl.vm_sims);
-    ACCESS("ffapl.coef_sims",     rv->ffapl.coef_sims);
-    ACCESS("kc.wPNKC",            rv->kc.wPNKC);
-    ACCESS("kc.wAPLKC",           rv->kc.wAPLKC);
-    ACCESS("kc.wKCAPL",           rv->kc.wKCAPL);
-    ACCESS("kc.pks",              rv->kc.pks);
-    ACCESS("kc.thr",              rv->kc.thr);
-    ACCESS("kc.responses",        rv->kc.responses);
-    ACCESS("kc.spike_counts",     rv->kc.spike_counts);
-    ACCESS("kc.vm_sims",          rv->kc.vm_sims);
-    ACCESS("kc.spike_recordings", rv->kc.spike_recordings);
-    ACCESS("kc.nves_sims",        rv->kc.nves_sims);
-    ACCESS("kc.inh_sims",         rv->kc.inh_sims);
-    ACCESS("kc.Is_sims",          rv->kc.Is_sims);
-    ACCESS("kc.tuning_iters",     rv->kc.tuning_iters);
+    SEXP upvar = access_upvar(*rv, name, val, set);
+    if (upvar) return upvar;
+    SEXP kcvar = access_kcvar(rv->kc, name, val, set);
+    if (kcvar) return kcvar;
 
     Rcpp::stop(std::string("invalid run variable: ") + name);
     return R_NilValue;
 )}
 
+extern "C" SEXP access_uvar(
+        SEXP uv_,
+        SEXP name_,
+        SEXP val, SEXP set_) { TRYFWD (
+    DEFFROM_AS(Rcpp::XPtr<UpstreamVars>, uv, uv_);
+    DEFFROM_AS(std::string, name, name_);
+    DEFFROM_AS(bool, set, set_);
+
+    SEXP upvar = access_upvar(*uv, name, val, set);
+    if (upvar) return upvar;
+
+    Rcpp::stop(std::string("invalid upstream variable: ") + name);
+    return R_NilValue;
+)}
+
+extern "C" SEXP access_kcrvar(
+        SEXP kv_,
+        SEXP name_,
+        SEXP val, SEXP set_) { TRYFWD (
+    DEFFROM_AS(Rcpp::XPtr<KCRunVars>, kv, kv_);
+    DEFFROM_AS(std::string, name, name_);
+    DEFFROM_AS(bool, set, set_);
+
+    SEXP kcvar = access_kcvar(kv->kc, name, val, set);
+    if (kcvar) return kcvar;
+
+    Rcpp::stop(std::string("invalid KC run variable: ") + name);
+    return R_NilValue;
+)}
+
 extern "C" SEXP set_log_destf(
         SEXP rv_,
         SEXP path_) { TRYFWD (
@@ -230,6 +310,23 @@ MP_RV_FUNC(run_ORN_LN_sims);
 MP_RV_FUNC(run_PN_sims);
 MP_RV_FUNC(run_FFAPL_sims);
 
+/* The same sims on an UpstreamVars, logging to the file at log_ (if not
+ * empty). */
+#define MP_UV_FUNC(wrapped) \
+extern "C" SEXP EXPORT_##wrapped##_uv(SEXP mp_, SEXP uv_, SEXP log_) { TRYFWD ( \
+    DEFFROM_AS(Rcpp::XPtr<ModelParams>, mp, mp_); \
+    DEFFROM_AS(Rcpp::XPtr<UpstreamVars>, uv, uv_); \
+    DEFFROM_AS(std::string, logpath, log_); \
+    Logger log; \
+    if (!logpath.empty()) log.redirect(logpath); \
+    wrapped(*mp, *uv, log); \
+    return R_NilValue; \
+)}
+
+MP_UV_FUNC(run_ORN_LN_sims);
+MP_UV_FUNC(run_PN_sims);
+MP_UV_FUNC(run_FFAPL_sims);
+
 extern "C" SEXP EXPORT_run_KC_sims(SEXP mp_, SEXP rv_, SEXP regen_) { TRYFWD (
     DEFFROM_AS(Rcpp::XPtr<ModelParams>, mp, mp_);
     DEFFROM_AS(Rcpp::XPtr<RunVars>, rv, rv_);
@@ -238,11 +335,60 @@ extern "C" SEXP EXPORT_run_KC_sims(SEXP mp_, SEXP rv_, SEXP regen_) { TRYFWD (
     return R_NilValue;
 )}
 
-extern "C" const R_CallMethodDef CallEntries[13] = {
+extern "C" SEXP EXPORT_run_KC_sims_kcrv(SEXP mp_, SEXP kv_, SEXP regen_) { TRYFWD (
+    DEFFROM_AS(Rcpp::XPtr<ModelParams>, mp, mp_);
+    DEFFROM_AS(Rcpp::XPtr<KCRunVars>, kv, kv_);
+    DEFFROM_AS(bool, regen, regen_);
+    run_KC_sims(*mp, *kv, regen);
+    return R_NilValue;
+)}
+
+SEXP wrap_replicates(KCReplicates const& out) {
+    return Rcpp::List::create(
+            Rcpp::Named("n")            = out.n,
+            Rcpp::Named("wPNKC")        = Rcpp::wrap<::Matrix>(out.wPNKC),
+            Rcpp::Named("wAPLKC")       = Rcpp::wrap<::Matrix>(out.wAPLKC),
+            Rcpp::Named("wKCAPL")       = Rcpp::wrap<::Matrix>(out.wKCAPL),
+            Rcpp::Named("spont_in")     = Rcpp::wrap<::Matrix>(out.spont_in),
+            Rcpp::Named("thr")          = Rcpp::wrap<::Matrix>(out.thr),
+            Rcpp::Named("responses")    = Rcpp::wrap<::Matrix>(out.responses),
+            Rcpp::Named("spike_counts") = Rcpp::wrap<::Matrix>(out.spike_counts),
+            Rcpp::Named("tuning_iters") = out.tuning_iters);
+}
+
+extern "C" SEXP EXPORT_run_KC_replicates(SEXP mp_, SEXP rv_, SEXP n_) { TRYFWD (
+    DEFFROM_AS(Rcpp::XPtr<ModelParams>, mp, mp_);
+    DEFFROM_AS(Rcpp::XPtr<RunVars>, rv, rv_);
+    DEFFROM_AS(unsigned, n, n_);
+    KCReplicates out;
+    run_KC_replicates(*mp, *rv, n, out);
+    return wrap_replicates(out);
+)}
+
+extern "C" SEXP EXPORT_run_KC_replicates_kcrv(SEXP mp_, SEXP kv_, SEXP n_) { TRYFWD (
+    DEFFROM_AS(Rcpp::XPtr<ModelParams>, mp, mp_);
+    DEFFROM_AS(Rcpp::XPtr<KCRunVars>, kv, kv_);
+    DEFFROM_AS(unsigned, n, n_);
+    KCReplicates out;
+    run_KC_replicates(*mp, *kv, n, out);
+    return wrap_replicates(out);
+)}
+
+extern "C" SEXP EXPORT_clear_warm_starts() { TRYFWD (
+    clear_warm_starts();
+    return R_NilValue;
+)}
+
+extern "C" const R_CallMethodDef CallEntries[25] = {
     {"mk_modelparams", (DL_FUNC) &mk_modelparams, 0},
     {"mk_runvars", (DL_FUNC) &mk_runvars, 1},
+    {"mk_upstreamvars", (DL_FUNC) &mk_upstreamvars, 1},
+    {"mk_kcrunvars", (DL_FUNC) &mk_kcrunvars, 2},
+    {"mk_kcrunvars_uv", (DL_FUNC) &mk_kcrunvars_uv, 2},
     {"access_mparam", (DL_FUNC) &access_mparam, 4},
     {"access_rvar", (DL_FUNC) &access_rvar, 4},
+    {"access_uvar", (DL_FUNC) &access_uvar, 4},
+    {"access_kcrvar", (DL_FUNC) &access_kcrvar, 4},
     {"set_log_destf", (DL_FUNC) &set_log_destf, 2},
     {"load_hc_data", (DL_FUNC) &EXPORT_load_hc_data, 2},
     {"build_wPNKC", (DL_FUNC) &EXPORT_build_wPNKC, 2},
@@ -250,7 +396,14 @@ extern "C" const R_CallMethodDef CallEntries[13] = {
     {"run_ORN_LN_sims", (DL_FUNC) &EXPORT_run_ORN_LN_sims, 2},
     {"run_PN_sims", (DL_FUNC) &EXPORT_run_PN_sims, 2},
     {"run_FFAPL_sims", (DL_FUNC) &EXPORT_run_FFAPL_sims, 2},
+    {"run_ORN_LN_sims_uv", (DL_FUNC) &EXPORT_run_ORN_LN_sims_uv, 3},
+    {"run_PN_sims_uv", (DL_FUNC) &EXPORT_run_PN_sims_uv, 3},
+    {"run_FFAPL_sims_uv", (DL_FUNC) &EXPORT_run_FFAPL_sims_uv, 3},
     {"run_KC_sims", (DL_FUNC) &EXPORT_run_KC_sims, 3},
+    {"run_KC_sims_kcrv", (DL_FUNC) &EXPORT_run_KC_sims_kcrv, 3},
+    {"run_KC_replicates", (DL_FUNC) &EXPORT_run_KC_replicates, 3},
+    {"run_KC_replicates_kcrv", (DL_FUNC) &EXPORT_run_KC_replicates_kcrv, 3},
+    {"clear_warm_starts", (DL_FUNC) &EXPORT_clear_warm_starts, 0},
     {NULL, NULL, 0}
 };
 extern "C" void R_init_olfsysm(DllInfo *dll) {
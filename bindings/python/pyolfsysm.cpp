@@ -40,12 +40,21 @@ PYBIND11_MODULE(olfsysm, m) {
         .def_property("time_dt",
                 [](ModelParams const *t){ return t->time.dt; },
                 [](ModelParams *t, double v){ t->time.dt = v; })
+        .def_property("time_integrator",
+                [](ModelParams const *t){ return t->time.integrator; },
+                [](ModelParams *t, std::string const& v){ t->time.integrator = v; })
         .def_property("time_stim_start",
                 [](ModelParams const *t){ return t->time.stim.start; },
                 [](ModelParams *t, double v){ t->time.stim.start = v; })
         .def_property("time_stim_end",
                 [](ModelParams const *t){ return t->time.stim.end; },
-                [](ModelParams *t, double v){ t->time.stim.end = v; });
+                [](ModelParams *t, double v){ t->time.stim.end = v; })
+        .def_property("time_quiescence_tol",
+                [](ModelParams const *t){ return t->time.quiescence_tol; },
+                [](ModelParams *t, double v){ t->time.quiescence_tol = v; })
+        .def_property("time_solve_spont",
+                [](ModelParams const *t){ return t->time.solve_spont; },
+                [](ModelParams *t, bool v){ t->time.solve_spont = v; });
 
     py::class_<ModelParams::ORN>(m, "MPORN")
         .def_readwrite("taum", &ModelParams::ORN::taum)
@@ -69,10 +78,12 @@ PYBIND11_MODULE(olfsysm, m) {
         .def_readwrite("tanhsc", &ModelParams::PN::tanhsc)
         .def_readwrite("inhsc", &ModelParams::PN::inhsc)
         .def_readwrite("inhadd", &ModelParams::PN::inhadd)
+        .def_readwrite("transfer", &ModelParams::PN::transfer)
         .def_readwrite("noise", &ModelParams::PN::noise);
     py::class_<ModelParams::PN::Noise>(m, "MPPNNoise")
         .def_readwrite("mean", &ModelParams::PN::Noise::mean)
-        .def_readwrite("sd", &ModelParams::PN::Noise::sd);
+        .def_readwrite("sd", &ModelParams::PN::Noise::sd)
+        .def_readwrite("seed", &ModelParams::PN::Noise::seed);
 
     py::class_<ModelParams::FFAPL>(m, "MPFFAPL")
         .def_readwrite("taum", &ModelParams::FFAPL::taum)
@@ -103,9 +114,12 @@ PYBIND11_MODULE(olfsysm, m) {
         .def_readwrite("use_fixed_thr", &ModelParams::KC::use_fixed_thr)
         .def_readwrite("use_homeostatic_thrs", &ModelParams::KC::use_homeostatic_thrs)
         .def_readwrite("thr_type", &ModelParams::KC::thr_type)
+        .def_readwrite("streaming_thr", &ModelParams::KC::streaming_thr)
         .def_readwrite("sp_target", &ModelParams::KC::sp_target)
         .def_readwrite("sp_acc", &ModelParams::KC::sp_acc)
+        .def_readwrite("apl_tuner", &ModelParams::KC::apl_tuner)
         .def_readwrite("sp_lr_coeff", &ModelParams::KC::sp_lr_coeff)
+        .def_readwrite("warm_start", &ModelParams::KC::warm_start)
         .def_readwrite("max_iters", &ModelParams::KC::max_iters)
         .def_readwrite("tune_from", &ModelParams::KC::tune_from)
         .def_readwrite("apltune_subsample", &ModelParams::KC::apltune_subsample)
@@ -114,6 +128,8 @@ PYBIND11_MODULE(olfsysm, m) {
         .def_readwrite("tau_apl2kc", &ModelParams::KC::tau_apl2kc)
         .def_readwrite("tau_r", &ModelParams::KC::tau_r)
         .def_readwrite("ves_p", &ModelParams::KC::ves_p)
+        .def_readwrite("odor_batch", &ModelParams::KC::odor_batch)
+        .def_readwrite("single_precision", &ModelParams::KC::single_precision)
         .def_readwrite("save_vm_sims", &ModelParams::KC::save_vm_sims)
         .def_readwrite("save_spike_recordings", &ModelParams::KC::save_spike_recordings)
         .def_readwrite("save_nves_sims", &ModelParams::KC::save_nves_sims)
@@ -123,18 +139,45 @@ PYBIND11_MODULE(olfsysm, m) {
 	/* TODO convert all values in DEFAULT_PARAMS to default kwargs on a python
        constructor */
 
-	py::class_<RunVars>(m, "RunVars")
-        .def_readwrite("orn", &RunVars::orn)
-        .def_readwrite("ln", &RunVars::ln)
-        .def_readwrite("pn", &RunVars::pn)
-        .def_readwrite("ffapl", &RunVars::ffapl)
+	py::class_<UpstreamVars, std::shared_ptr<UpstreamVars>>(m, "UpstreamVars")
+        .def_readwrite("orn", &UpstreamVars::orn)
+        .def_readwrite("ln", &UpstreamVars::ln)
+        .def_readwrite("pn", &UpstreamVars::pn)
+        .def_readwrite("ffapl", &UpstreamVars::ffapl)
+        .def(py::init<ModelParams const&>());
+
+	py::class_<RunVars, UpstreamVars, std::shared_ptr<RunVars>>(m, "RunVars")
         .def_readwrite("kc", &RunVars::kc)
         .def_readonly("log", &RunVars::log)
         .def(py::init<ModelParams const&>());
 
+    /* Keeps the UpstreamVars (or RunVars) it is given alive. */
+    py::class_<KCRunVars>(m, "KCRunVars")
+        .def_property_readonly("upstream", [](KCRunVars const& kv){
+            return std::const_pointer_cast<UpstreamVars>(kv.upstream);
+        })
+        .def_readwrite("kc", &KCRunVars::kc)
+        .def_readonly("log", &KCRunVars::log)
+        .def(py::init([](ModelParams const& p, std::shared_ptr<UpstreamVars> up){
+            return std::unique_ptr<KCRunVars>(new KCRunVars(p, up));
+        }));
+
+    py::class_<KCReplicates>(m, "KCReplicates")
+        .def(py::init<>())
+        .def_readwrite("n", &KCReplicates::n)
+        .def_readwrite("wPNKC", &KCReplicates::wPNKC)
+        .def_readwrite("wAPLKC", &KCReplicates::wAPLKC)
+        .def_readwrite("wKCAPL", &KCReplicates::wKCAPL)
+        .def_readwrite("spont_in", &KCReplicates::spont_in)
+        .def_readwrite("thr", &KCReplicates::thr)
+        .def_readwrite("responses", &KCReplicates::responses)
+        .def_readwrite("spike_counts", &KCReplicates::spike_counts)
+        .def_readwrite("tuning_iters", &KCReplicates::tuning_iters);
+
     // TODO also expose 'disable'? cause problems w/ things writing to same file
     // sequentially if not?
     py::class_<Logger>(m, "RVLogger")
+        .def(py::init<>())
         .def("redirect", py::overload_cast<const std::string &>(&Logger::redirect));
 
     py::class_<RunVars::ORN>(m, "RVORN")
@@ -169,20 +212,32 @@ PYBIND11_MODULE(olfsysm, m) {
         .def_readwrite("nves_sims", &RunVars::KC::nves_sims)
         .def_readwrite("inh_sims", &RunVars::KC::inh_sims)
         .def_readwrite("Is_sims", &RunVars::KC::Is_sims)
-        .def_readwrite("tuning_iters", &RunVars::KC::tuning_iters);
+        .def_readwrite("tuning_iters", &RunVars::KC::tuning_iters)
+        .def_readwrite("tuning_w", &RunVars::KC::tuning_w)
+        .def_readwrite("tuning_sp", &RunVars::KC::tuning_sp);
 
     m.def("load_hc_data", &load_hc_data, R"pbdoc(
         Load HC data from file.
     )pbdoc");
 
-    m.def("build_wPNKC", &build_wPNKC, R"pbdoc(
+    m.def("build_wPNKC",
+            py::overload_cast<ModelParams const&, RunVars&>(&build_wPNKC), R"pbdoc(
         Choose between the above functions appropriately.
     )pbdoc");
+    m.def("build_wPNKC",
+            py::overload_cast<ModelParams const&, KCRunVars&>(&build_wPNKC));
 
-    m.def("fit_sparseness", &fit_sparseness, R"pbdoc(
+    m.def("fit_sparseness",
+            py::overload_cast<ModelParams const&, RunVars&>(&fit_sparseness), R"pbdoc(
         Set KC spike thresholds, and tune APL<->KC weights until reaching the
         desired sparsity.
     )pbdoc");
+    m.def("fit_sparseness",
+            py::overload_cast<ModelParams const&, KCRunVars&>(&fit_sparseness));
+
+    m.def("clear_warm_starts", &clear_warm_starts, R"pbdoc(
+        Forget all APL tunings remembered for ModelParams.kc.warm_start.
+    )pbdoc");
 
     m.def("sim_ORN_layer", &sim_ORN_layer, R"pbdoc(
         Model ORN response for one odor.
@@ -200,23 +255,62 @@ PYBIND11_MODULE(olfsysm, m) {
         Model KC response for one odor.
     )pbdoc");
 
-    m.def("run_ORN_LN_sims", &run_ORN_LN_sims, R"pbdoc(
+    m.def("sim_KC_layer_batch", &sim_KC_layer_batch, R"pbdoc(
+        Model KC response to several odors at once, keeping only spike counts
+        and peak membrane voltages.
+    )pbdoc");
+
+    m.def("run_ORN_LN_sims",
+            py::overload_cast<ModelParams const&, RunVars&>(&run_ORN_LN_sims), R"pbdoc(
         Run ORN and LN sims for all odors.
+        Also takes an UpstreamVars and an RVLogger, as do run_PN_sims and
+        run_FFAPL_sims.
     )pbdoc");
+    m.def("run_ORN_LN_sims",
+            py::overload_cast<ModelParams const&, UpstreamVars&, Logger&>(&run_ORN_LN_sims));
 
-    m.def("run_PN_sims", &run_PN_sims, R"pbdoc(
+    m.def("run_PN_sims",
+            py::overload_cast<ModelParams const&, RunVars&>(&run_PN_sims), R"pbdoc(
         Run PN sims for all odors.
     )pbdoc");
+    m.def("run_PN_sims",
+            py::overload_cast<ModelParams const&, UpstreamVars&, Logger&>(&run_PN_sims));
 
-    m.def("run_FFAPL_sims", &run_FFAPL_sims, R"pbdoc(
+    m.def("run_FFAPL_sims",
+            py::overload_cast<ModelParams const&, RunVars&>(&run_FFAPL_sims), R"pbdoc(
         Run FFAPL sims for all oors.
     )pbdoc");
+    m.def("run_FFAPL_sims",
+            py::overload_cast<ModelParams const&, UpstreamVars&, Logger&>(&run_FFAPL_sims));
 
-    m.def("run_KC_sims", &run_KC_sims, R"pbdoc(
+    m.def("run_KC_sims",
+            py::overload_cast<ModelParams const&, RunVars&, bool>(&run_KC_sims), R"pbdoc(
         Regenerate PN->KC connectivity, re-tune thresholds and APL, and run KC sims
         for all odors.
         Connectivity regeneration can be turned off by passing regen=false.
+        Also takes a KCRunVars, leaving its upstream sims alone.
+    )pbdoc");
+    m.def("run_KC_sims",
+            py::overload_cast<ModelParams const&, KCRunVars&, bool>(&run_KC_sims));
+
+    m.def("run_KC_replicates",
+            py::overload_cast<ModelParams const&, RunVars&, unsigned, KCReplicates&>(
+                &run_KC_replicates), R"pbdoc(
+        Build, tune and run n KC replicates (streams r of kc.seed) on the upstream sims
+        already in rv, writing them stacked by replicate into a KCReplicates.
+        Replicate 0 matches run_KC_sims; rv.kc is left untouched.
+        Also takes a KCRunVars, or an UpstreamVars and an RVLogger (with the
+        preset wPNKC, if any, given after the KCReplicates); the upstream sims
+        are only read.
     )pbdoc");
+    m.def("run_KC_replicates",
+            py::overload_cast<ModelParams const&, KCRunVars&, unsigned, KCReplicates&>(
+                &run_KC_replicates));
+    m.def("run_KC_replicates",
+            py::overload_cast<ModelParams const&, UpstreamVars const&, Logger&,
+                unsigned, KCReplicates&, Matrix const&>(&run_KC_replicates),
+            py::arg("p"), py::arg("up"), py::arg("log"), py::arg("n"),
+            py::arg("out"), py::arg("wPNKC") = Matrix());
 
 #ifdef VERSION_INFO
     m.attr("__version__") = VERSION_INFO;
@@ -6,6 +6,7 @@
 #include <functional>
 #include <mutex>
 #include <fstream>
+#include <memory>
 #include "Eigen/Dense"
 
 /* Used for thread-safe logging. */
@@ -74,6 +75,37 @@ struct ModelParams {
         /* Simulation timestep. */
         double dt;
 
+        /* How leaky state variables are stepped forward:
+         * - "euler": forward Euler (the default). Needs dt well below the
+         *   shortest time constant (10 ms by default).
+         * - "exp": exponential Euler; the leak toward each variable's
+         *   current target is integrated exactly over the step (decay factor
+         *   exp(-dt/tau)), so larger timesteps stay stable. KC responses
+         *   still drift from the 0.5 ms ones as dt grows; see
+         *   tools/dt_validation.cpp. */
+        std::string integrator;
+
+        /* Stop integrating a layer after the stimulus once no state variable
+         * has more than this much drift left (its per-timestep change, times
+         * the slowest time constant feeding the layer, over dt), and no KC
+         * has spiked, for a few dozen timesteps in a row. Later timesteps
+         * then hold the last state; decaying KC vesicle pools and APL
+         * activity are still filled in exactly. PN layers never stop early
+         * while PN noise is on. 0 (the default) always integrates to the
+         * end. */
+        double quiescence_tol;
+
+        /* Start the ORN, LN and PN layers at time start already settled at
+         * their spontaneous fixed point (solved for directly), instead of
+         * integrating them from pre_start until they get there. The sims keep
+         * their pre_start-based layout, with the fixed point filled in up to
+         * start. Only takes effect if the stimulus starts no earlier than
+         * start. With PN noise on, the PNs start from the noiseless fixed
+         * point. Results shift slightly, since the default settling time
+         * leaves the slower LN inhibition (tauGB) a few percent short of
+         * rest. Off by default. */
+        bool solve_spont;
+
         /* Calculate the pretime-relative start step. */
         unsigned start_step() const;
 
@@ -134,10 +166,26 @@ struct ModelParams {
         double inhsc;
         double inhadd;
 
+        /* How the tanh on PN input is evaluated:
+         * - "tanh": the math library's tanh (the default).
+         * - "rational": a 13/6 rational fit, clamped to |x| <= 9; within
+         *   3e-8 of tanh everywhere (the PN drive, 200*tanh, within 6e-6).
+         * - "table": linear interpolation in a table over [0, 9], at 256
+         *   entries per unit; within 1.5e-6 of tanh (drive within 3e-4).
+         * Both approximations cut run_PN_sims time by about a quarter to a
+         * third, and can flip a few KC spike counts; tools/pn_transfer.cpp
+         * measures both. */
+        std::string transfer;
+
         /* Gaussian noise parameters. */
         struct Noise {
             double mean;
             double sd;
+
+            /* RNG seed for the noise. Every odor draws from its own stream,
+             * so noisy runs repeat exactly whatever the number of threads.
+             * If seed=0, each odor gets a seed from a std::random_device. */
+            unsigned seed;
         } noise;
     } pn;
 
@@ -165,7 +213,9 @@ struct ModelParams {
         bool preset_wPNKC;
 
         /* RNG seed to be used for KC-PN connectivity matrix generation. If
-         * seed=0, then a seed is generated by a std::random_device. */
+         * seed=0, then a seed is generated by a std::random_device. Every KC
+         * (of every replicate, see run_KC_replicates) draws from its own
+         * stream of the seed, so the matrix does not depend on threading. */
         unsigned seed;
 
         /* Multiplicative current weights assigned to each PN. If left empty,
@@ -203,6 +253,16 @@ struct ModelParams {
          * Fixed: all thrs are set to a fixed value (fixed_thr). */
         std::string thr_type;
 
+        /* Choose thresholds as the odors are simulated, a block at a time,
+         * instead of from the whole KCs x odors matrix of peaks (which is then
+         * never kept; RunVars::KC::pks is left empty). Homeostatic thresholds
+         * come out exactly the same; uniform ones come from a histogram of
+         * the peaks, and are up to 2^-11 (relative) below the exact value.
+         * The histogram takes 4 MB per thread. Without the stored peaks, APL
+         * tuning cannot skip the KCs that are unable to fire, so this trades
+         * tuning time for memory. */
+        bool streaming_thr;
+
         /* The target sparsity. */
         double sp_target;
 
@@ -210,9 +270,23 @@ struct ModelParams {
          * acceptable sparsity. */
         double sp_acc;
 
+        /* How APL<->KC weights are tuned toward the target sparsity:
+         * - "lr": step the weights by the sparsity error, with a step size
+         *   that shrinks with each iteration (see sp_lr_coeff).
+         * - "root": bracket the target (sparsity only falls as the weights
+         *   grow), then close in on it with Illinois false-position steps.
+         * Default "lr". */
+        std::string apl_tuner;
+
         /* Changes the scaling of the ~1/(n^2) tuning step-size curve. */
         double sp_lr_coeff;
 
+        /* Start APL tuning from the weights that the last successful tuning
+         * with the same model (apart from seeds, tuning and performance
+         * options) converged to in this process, if any. See
+         * clear_warm_starts(). */
+        bool warm_start;
+
         /* The maximum number of tuning iterations that should be done before
          * aborting. Must be >=1. */
         unsigned max_iters;
@@ -236,6 +310,22 @@ struct ModelParams {
         double tau_r;
         double ves_p;
 
+        /* The number of odors to simulate together (see sim_KC_layer_batch)
+         * during tuning and in run_KC_sims. Batching is only used where no
+         * per-timestep output is saved. 1 disables batching. A batch is
+         * padded to a whole number of 64-byte vectors (8 odors in double
+         * precision, 16 in single), so smaller batches are slower than none.
+         * Full batches take roughly half to two thirds of the unbatched
+         * time. */
+        unsigned odor_batch;
+
+        /* Run the KC layer in single precision. Inputs are converted and
+         * outputs are stored as double as usual; only the integration itself
+         * is done in float. Thresholds agree with the double-precision model
+         * to ~1e-7 (relative); spike counts may occasionally differ by one
+         * where a KC sits right at threshold. */
+        bool single_precision;
+
         /* Output options. */
         bool save_vm_sims;
         bool save_spike_recordings;
@@ -292,10 +382,10 @@ struct ModelParams {
 };
 extern ModelParams const DEFAULT_PARAMS;
 
-/* Variables and storage space that is useful to each run.
- * Matrices that are not used (e.g., KC-related matrices when KC simulation is
- * disabled) are never allocated because of Eigen's lazy evalulation system. */
-struct RunVars {
+/* Results of the upstream (ORN, LN, PN and feedforward APL) sims. Nothing
+ * about a KC replicate goes into these, so once they have been run they can be
+ * shared read-only between any number of KC runs (see KCRunVars). */
+struct UpstreamVars {
     /* ORN-related variables. */
     struct ORN {
         /* Simulation results. */
@@ -340,6 +430,15 @@ struct RunVars {
         FFAPL(ModelParams const&);
     } ffapl;
 
+    /* Info from the model parameters is needed to correctly initialize matrix
+     * sizes.*/
+    UpstreamVars(ModelParams const&);
+};
+
+/* Variables and storage space that is useful to each run.
+ * Matrices that are not used (e.g., KC-related matrices when KC simulation is
+ * disabled) are never allocated because of Eigen's lazy evalulation system. */
+struct RunVars : UpstreamVars {
     /* KC-related variables. */
     struct KC {
         /* A->B connectivity matrices. */
@@ -347,8 +446,29 @@ struct RunVars {
         Column wAPLKC;
         Row    wKCAPL;
 
+        /* Claw-list form of wPNKC, which is what the KC layer actually
+         * integrates with. Every KC gets the same number of claw slots; slots
+         * left over (dropped claws, or KCs with fewer inputs) have zero weight.
+         * Rebuilt by build_wPNKC, and by KC sims and fits whenever wPNKC no
+         * longer matches the one it was built from (e.g., after a hand
+         * edit). */
+        struct Claws {
+            /* Number of claw slots per KC. */
+            unsigned n;
+
+            /* Glomerulus of each slot; KC-major, n slots per KC. */
+            std::vector<unsigned> gloms;
+
+            /* Weight of each slot, with ModelParams::KC::currents applied. */
+            std::vector<double> weights;
+
+            /* Fingerprint of the wPNKC the list was built from. */
+            std::size_t source;
+        } claws;
+
         /* Peak membrane potentials achieved on the training set before
-         * applying firing thresholds. */
+         * applying firing thresholds (empty with ModelParams::KC::
+         * streaming_thr). */
         Matrix pks;
 
         /* Spontaneous input each KC receives. Threshold typically added to this. */
@@ -380,6 +500,9 @@ struct RunVars {
 
         /* The number of iterations done during APL tuning. */
         unsigned tuning_iters;
+        /* The APL->KC weight and resulting sparsity at each iteration. */
+        std::vector<double> tuning_w;
+        std::vector<double> tuning_sp;
 
         /* Initialize matrices with the correct sizes and quantities. */
         KC(ModelParams const&);
@@ -393,15 +516,36 @@ struct RunVars {
     RunVars(ModelParams const&);
 };
 
+/* The KC side of a run, on upstream sims that it only reads and may share
+ * with other KC runs (e.g. a RunVars held by a shared_ptr, whose own KC
+ * variables are then left alone). */
+struct KCRunVars {
+    /* Upstream sims to run the KCs on. */
+    std::shared_ptr<UpstreamVars const> upstream;
+
+    /* KC-related variables, as in RunVars. */
+    RunVars::KC kc;
+
+    /* Logger for this run. */
+    Logger log;
+
+    KCRunVars(ModelParams const&, std::shared_ptr<UpstreamVars const>);
+};
+
 /* Load HC data from file. */
 void load_hc_data(ModelParams& p, std::string const& fpath);
 
 /* Choose between the above functions appropriately. */
 void build_wPNKC(ModelParams const& p, RunVars& rv);
+void build_wPNKC(ModelParams const& p, KCRunVars& kv);
 
 /* Set KC spike thresholds, and tune APL<->KC weights until reaching the
  * desired sparsity. */
 void fit_sparseness(ModelParams const& p, RunVars& rv);
+void fit_sparseness(ModelParams const& p, KCRunVars& kv);
+
+/* Forget all APL tunings remembered for ModelParams::KC::warm_start. */
+void clear_warm_starts();
 
 /* Model ORN response for one odor. */
 void sim_ORN_layer(
@@ -418,6 +562,7 @@ void sim_LN_layer(
 /* Model PN response to one odor. */
 void sim_PN_layer(
         ModelParams const& p, RunVars const& rv,
+        int odorid,
         Matrix const& orn_t, Row const& inhA, Row const& inhB,
         Matrix& pn_t);
 
@@ -433,18 +578,89 @@ void sim_KC_layer(
         Matrix const& pn_t, Vector const& ffapl_t,
         Matrix& Vm, Matrix& spikes, Matrix& nves, Row& inh, Row& Is);
 
-/* Run ORN and LN sims for all odors. */
+/* Optional timecourse outputs of sim_KC_layer_stream (KCs x timesteps, or
+ * 1 x timesteps for the APL); those left null are not recorded. */
+struct KCRecording {
+    Matrix* Vm     = nullptr;
+    Matrix* spikes = nullptr;
+    Matrix* nves   = nullptr;
+    Row*    inh    = nullptr;
+    Row*    Is     = nullptr;
+};
+
+/* Model KC response to one odor, keeping only the current state of each KC.
+ * Spike counts and peak membrane voltages are accumulated as the simulation
+ * runs; full timecourses are only kept for what is requested in rec. */
+void sim_KC_layer_stream(
+        ModelParams const& p, RunVars const& rv,
+        Matrix const& pn_t, Vector const& ffapl_t,
+        Column& spike_counts, Column& Vm_peak,
+        KCRecording const& rec = KCRecording());
+
+/* Model KC response to several odors at once, advancing all of them together
+ * through each timestep. Only the spike counts and peak membrane voltages are
+ * kept (KCs x odors, in the order given). In double precision these are the
+ * same as from sim_KC_layer_stream. */
+void sim_KC_layer_batch(
+        ModelParams const& p, RunVars const& rv,
+        std::vector<unsigned> const& odors,
+        Matrix& spike_counts, Matrix& Vm_peaks);
+
+/* Run ORN and LN sims for all odors. The UpstreamVars forms of this and the
+ * next two only need the upstream sims, and log to log. */
 void run_ORN_LN_sims(ModelParams const& p, RunVars& rv);
+void run_ORN_LN_sims(ModelParams const& p, UpstreamVars& up, Logger& log);
 
 /* Run PN sims for all odors. */
 void run_PN_sims(ModelParams const& p, RunVars& rv);
+void run_PN_sims(ModelParams const& p, UpstreamVars& up, Logger& log);
 
 /* Run feedforward APL sims for all odors. */
 void run_FFAPL_sims(ModelParams const& p, RunVars& rv);
+void run_FFAPL_sims(ModelParams const& p, UpstreamVars& up, Logger& log);
 
 /* Regenerate PN->KC connectivity, re-tune thresholds and APL, and run KC sims
  * for all odors.
  * Connectivity regeneration can be turned off by passing regen=false. */
 void run_KC_sims(ModelParams const& p, RunVars& rv, bool regen=true);
+void run_KC_sims(ModelParams const& p, KCRunVars& kv, bool regen=true);
+
+/* The KC side of several connectivity replicates built on the same upstream
+ * sims (see run_KC_replicates). Per-KC results are stacked by replicate:
+ * replicate r has rows r*N to (r+1)*N-1 (columns, for wKCAPL), with N =
+ * ModelParams::KC::N. */
+struct KCReplicates {
+    /* Number of replicates. */
+    unsigned n;
+
+    /* As in RunVars::KC, stacked. */
+    Matrix wPNKC;
+    Column wAPLKC;
+    Row    wKCAPL;
+    Column spont_in;
+    Column thr;
+    Matrix responses;
+    Matrix spike_counts;
+
+    /* The number of APL tuning iterations of each replicate. */
+    std::vector<unsigned> tuning_iters;
+};
+
+/* Generate n independent KC replicates on top of the ORN/LN/PN (and FFAPL)
+ * sims in up: build wPNKC, fit thresholds and APL weights, and run KC sims
+ * for all odors, for each. The work is shared out over replicates x odors
+ * together. Replicate r draws its connectivity from stream r of
+ * ModelParams::KC::seed (random seeds if that is 0), so replicate 0 matches
+ * run_KC_sims with the same seed; with preset_wPNKC, every replicate uses
+ * wPNKC. No timecourses are saved. */
+void run_KC_replicates(ModelParams const& p, UpstreamVars const& up,
+        Logger& log, unsigned n, KCReplicates& out,
+        Matrix const& wPNKC = Matrix());
+/* Same, on the upstream sims of rv or kv, with the preset wPNKC (if any)
+ * taken from their KC variables, which are otherwise left as they are. */
+void run_KC_replicates(ModelParams const& p, RunVars& rv, unsigned n,
+        KCReplicates& out);
+void run_KC_replicates(ModelParams const& p, KCRunVars& kv, unsigned n,
+        KCReplicates& out);
 
 #endif
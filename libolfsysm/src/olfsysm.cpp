@@ -9,6 +9,18 @@
 #include <iostream>
 #include <functional>
 #include <sstream>
+#include <array>
+#include <utility>
+#include <map>
+#include <mutex>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define OLFSYSM_X86_DISPATCH
+#include <immintrin.h>
+#endif
 
 Logger::Logger() {}
 Logger::Logger(Logger const&) {
@@ -41,9 +53,8 @@ std::string cat(Args&&... args) {
     return ss.str();
 }
 
-/* For random number generation. */
+/* For seeding random number generation when no seed is given. */
 thread_local std::random_device g_randdev;
-thread_local std::mt19937 g_randgen{g_randdev()};
 
 ModelParams const DEFAULT_PARAMS = []() {
     ModelParams p;
@@ -54,6 +65,9 @@ ModelParams const DEFAULT_PARAMS = []() {
     p.time.stim.start = 0.0;
     p.time.stim.end   = 0.5;
     p.time.dt         = 0.5e-3;
+    p.time.integrator = "euler";
+    p.time.quiescence_tol = 0.0;
+    p.time.solve_spont    = false;
 
     p.orn.taum             = 0.01;
     p.orn.n_physical_gloms = 51;
@@ -70,8 +84,10 @@ ModelParams const DEFAULT_PARAMS = []() {
     p.pn.tanhsc     = 5.3395;
     p.pn.inhsc      = 368.6631;
     p.pn.inhadd     = 31.4088;
+    p.pn.transfer   = "tanh";
     p.pn.noise.mean = 0.0;
     p.pn.noise.sd   = 0.0;
+    p.pn.noise.seed = 0;
 
     p.kc.N                     = 2000;
     p.kc.nclaws                = 6;
@@ -86,9 +102,12 @@ ModelParams const DEFAULT_PARAMS = []() {
     p.kc.use_fixed_thr         = false;
     p.kc.use_homeostatic_thrs  = true;
     p.kc.thr_type              = "";
+    p.kc.streaming_thr         = false;
     p.kc.sp_target             = 0.1;
     p.kc.sp_acc                = 0.1;
+    p.kc.apl_tuner             = "lr";
     p.kc.sp_lr_coeff           = 10.0;
+    p.kc.warm_start            = false;
     p.kc.max_iters             = 10;
     p.kc.apltune_subsample     = 1;
     p.kc.taum                  = 0.01;
@@ -96,6 +115,8 @@ ModelParams const DEFAULT_PARAMS = []() {
     p.kc.tau_apl2kc            = 0.01;
     p.kc.tau_r                 = 1.0;
     p.kc.ves_p                 = 0.0;
+    p.kc.odor_batch            = 1;
+    p.kc.single_precision      = false;
     p.kc.save_vm_sims          = false;
     p.kc.save_spike_recordings = false;
     p.kc.save_nves_sims        = false;
@@ -123,8 +144,233 @@ void split_regular_csv(std::string const& str, std::vector<std::string>& vec);
  * Instead of returning the smoothed matrix, it smooths it in-place. */
 void smoothts_exp(Matrix& vin, double wsize);
 
-/* Fill out with numbers generated by rng. */
-void add_randomly(std::function<double()> rng, Matrix& out);
+/* What a random stream is used for (see Philox). */
+enum RNGLayer : std::uint32_t {
+    RNG_WPNKC    = 1,
+    RNG_PN_NOISE = 2
+};
+
+/* Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2,
+ * 3", 2011), a counter-based generator. Each (seed, replicate, index, layer)
+ * names its own independent stream, where index is whatever the layer
+ * divides its draws by (KCs for wPNKC, odors for PN noise), so results do not
+ * depend on which thread does what, or in what order. Usable as a standard
+ * UniformRandomBitGenerator. */
+class Philox {
+public:
+    using result_type = std::uint32_t;
+
+    Philox(std::uint32_t seed, std::uint32_t replicate, std::uint32_t index,
+            RNGLayer layer);
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT32_MAX; }
+    result_type operator()();
+
+    /* Fill out with the next n whole blocks (4 words each) of the stream,
+     * many at a time; any words left in the current block are skipped. */
+    void blocks(std::uint32_t* out, std::size_t n);
+
+private:
+    std::array<std::uint32_t, 4> ctr;
+    std::array<std::uint32_t, 2> key;
+    std::array<std::uint32_t, 4> out;
+    unsigned used;
+
+    /* Encrypt the next counter into out. */
+    void next_block();
+};
+
+/* A seed for the given stream: seed itself, or a fresh random one if that is
+ * 0. */
+std::uint32_t stream_seed(unsigned seed);
+
+/* Fill out (n values) with normal variates from rng, by the Box-Muller
+ * transform, in bulk: the uniforms are drawn first (into scratch), then
+ * transformed together in one vectorizable pass. */
+void fill_normal(Philox& rng, double mean, double sd,
+        double* out, unsigned n, std::vector<std::uint32_t>& scratch);
+
+/* The fraction of the way toward its current target that a leaky variable
+ * with time constant tau moves in one timestep (see
+ * ModelParams::Time::integrator). */
+double step_coef(ModelParams const& p, double tau);
+
+/* How many consecutive quiescent timesteps end a simulation early. */
+unsigned const QUIESCENCE_STEPS = 32;
+
+/* Detects when a layer has settled after the stimulus (see
+ * ModelParams::Time::quiescence_tol). */
+struct Quiescence {
+    double tol;
+    /* Converts a per-step change into the drift left to settle. */
+    double scale;
+    /* The first step that may count as quiescent. */
+    unsigned from;
+    /* The number of consecutive quiescent steps so far. */
+    unsigned quiet;
+
+    /* tau is the slowest time constant that the layer (or anything upstream
+     * of it) may still be relaxing with. */
+    Quiescence(ModelParams const& p, double tau);
+    bool enabled() const;
+    /* Report the largest per-step state change over the given number of
+     * steps, ending at step t. Returns true once the layer has been quiescent
+     * for QUIESCENCE_STEPS steps. */
+    bool operator()(unsigned t, double change, unsigned steps = 1);
+};
+
+/* Transfer functions for the PN input nonlinearity (see
+ * ModelParams::PN::transfer). Each is a small inline functor, so it can be
+ * vectorized along with the rest of the PN update. */
+struct TanhLibm {
+    double operator()(double x) const {
+        return std::tanh(x);
+    }
+};
+/* Eigen's rational fit for single-precision tanh (odd degree-13 over even
+ * degree-6 polynomials), evaluated in double. Past |x| = 9 tanh is 1 to
+ * within 3e-8 anyway. */
+struct TanhRational {
+    double operator()(double x) const {
+        x = std::min(9.0, std::max(-9.0, x));
+        double const x2 = x*x;
+        double num = -2.76076847742355e-16;
+        num = num*x2 + 2.00018790482477e-13;
+        num = num*x2 - 8.60467152213735e-11;
+        num = num*x2 + 5.12229709037114e-08;
+        num = num*x2 + 1.48572235717979e-05;
+        num = num*x2 + 6.37261928875436e-04;
+        num = num*x2 + 4.89352455891786e-03;
+        double den = 1.19825839466702e-06;
+        den = den*x2 + 1.18534705686654e-04;
+        den = den*x2 + 2.26843463243900e-03;
+        den = den*x2 + 4.89352518554385e-03;
+        return x*num/den;
+    }
+};
+/* Linear interpolation in a table of tanh over [0, XMAX], extended to
+ * negative x by symmetry. The table is built once and shared. */
+struct TanhTable {
+    static constexpr double XMAX = 9.0;
+    static constexpr unsigned PER_UNIT = 256;
+    double const* y;
+
+    TanhTable();
+    double operator()(double x) const {
+        double const s = std::min(std::abs(x), XMAX)*PER_UNIT;
+        unsigned const i = unsigned(s);
+        double const v = y[i] + (s-i)*(y[i+1]-y[i]);
+        return std::copysign(v, x);
+    }
+};
+
+/* The slowest time constants up to and including each layer. */
+double orn_settle_tau(ModelParams const& p);
+double ln_settle_tau(ModelParams const& p);
+double pn_settle_tau(ModelParams const& p);
+double kc_settle_tau(ModelParams const& p);
+
+/* The last step that ModelParams::Time::solve_spont fills in with the
+ * spontaneous fixed point, integration picking up after it; 0 if it is off
+ * (or does not apply). */
+unsigned spont_steps(ModelParams const& p);
+
+/* The LN layer's spontaneous fixed point, under a constant mean ORN rate. */
+void ln_fixed_point(ModelParams const& p, double orn_mean,
+        double& potential, double& response);
+
+/* The ORN layer is linear, and its input is a constant plus a 0/1 stimulus
+ * row scaled per glomerulus and odor. So every ORN trace is spont+delta*r(t),
+ * with the same r for every glomerulus and odor; this computes it once. */
+struct ORNStimResponse {
+    /* The smoothed stimulus (the ORN input's odor part), and the ORN response
+     * to it, per unit delta. */
+    Row input;
+    Row response;
+
+    ORNStimResponse(ModelParams const& p);
+
+    /* How many steps of an odor's ORN traces are simulated before they hold
+     * (see ModelParams::Time::quiescence_tol), given its largest |delta|. */
+    unsigned active_steps(ModelParams const& p, double dmax) const;
+};
+
+/* The last step of the stretch before the stimulus that every odor's LN, PN
+ * and FFAPL sims share (every odor's ORN input is exactly spont until then).
+ * The run_*_sims functions simulate it once, and fork each odor from its
+ * end. 0 if there is nothing to share (or PN noise makes every odor differ
+ * from the start). */
+unsigned shared_prefix_steps(ModelParams const& p);
+
+/* The shared LN prefix (see shared_prefix_steps), from which every odor's LN
+ * simulation can be forked. */
+struct LNPrefix {
+    /* inhA and inhB up to and including the last shared step. */
+    Row inhA, inhB;
+    /* The LN potential at that step. */
+    double potential;
+
+    LNPrefix(ModelParams const& p, unsigned last);
+};
+
+/* sim_LN_layer for a batch of odors in lock-step, each one a SIMD lane, for
+ * as many steps as orn_mean (each odor's mean ORN rate, odors x steps) has;
+ * inhA and inhB are sized to match. Every odor starts from the end of prefix
+ * (copied in) if given, else from scratch. If potential_end is given, it gets
+ * each odor's potential at the last step. */
+void sim_LN_layer_batch(
+        ModelParams const& p,
+        Matrix const& orn_mean,
+        Matrix& inhA, Matrix& inhB,
+        LNPrefix const* prefix = nullptr,
+        std::vector<double>* potential_end = nullptr);
+
+/* The number of odors run_ORN_LN_sims gives each sim_LN_layer_batch. */
+unsigned const LN_BATCH = 8;
+
+/* sim_PN_layer, for as many steps as orn_t has, forked from the end of
+ * prefix (the first steps of pn_t shared by every odor; see
+ * shared_prefix_steps) if given. */
+void sim_PN_layer_from(
+        ModelParams const& p,
+        int odorid,
+        Matrix const& orn_t, Row const& inhA, Row const& inhB,
+        Matrix& pn_t, Matrix const* prefix);
+
+/* The shared raw FFAPL prefix (before the spont adjustments in
+ * sim_FFAPL_layer; see shared_prefix_steps). */
+struct FFAPLPrefix {
+    Row vm, coef;
+
+    FFAPLPrefix(ModelParams const& p, Column const& pn_spont,
+            Matrix const& pn_t, unsigned last);
+};
+
+/* Integrate the raw FFAPL timecourse over steps t0+1 to t1-1, with those up to
+ * t0 already filled in. */
+void integrate_FFAPL(ModelParams const& p, Column const& pn_spont,
+        Matrix const& pn_t, Vector& ffapl_t, Vector& coef_t,
+        unsigned t0, unsigned t1);
+
+/* sim_FFAPL_layer, given the spontaneous PN rates, and forked from the end of
+ * prefix if given. */
+void sim_FFAPL_layer_from(
+        ModelParams const& p, Column const& pn_spont,
+        Matrix const& pn_t,
+        Vector& ffapl_t, Vector& coef_t,
+        FFAPLPrefix const* prefix);
+
+/* Whether a and b agree bit for bit in (have, and are equal over) their first
+ * n columns. */
+bool same_prefix(Matrix const& a, Matrix const& b, unsigned n);
+
+/* sim_ORN_layer, filled in straight from the shared stimulus response.
+ * Returns how many steps were simulated before the traces hold. */
+unsigned sim_ORN_layer_from(
+        ModelParams const& p, ORNStimResponse const& stim,
+        int odorid,
+        Matrix& orn_t);
 
 /* Calculate the Gini-type FFAPL coefficient. */
 double ffapl_coef_gini(ModelParams const& p,
@@ -134,20 +380,313 @@ double ffapl_coef_gini(ModelParams const& p,
 double ffapl_coef_lts(ModelParams const& p,
         Column const& pn, Column const& pn_spont);
 
+/* Sampler for a fixed discrete distribution, by Walker's alias method (as
+ * constructed by Vose): one table lookup and a coin flip per draw, however
+ * many outcomes there are. */
+struct AliasTable {
+    /* Outcome i is kept if a 32-bit draw is below keep[i], else alias[i] is
+     * taken instead. */
+    std::vector<std::uint64_t> keep;
+    std::vector<unsigned> alias;
+
+    /* Outcomes are drawn in proportion to weights. */
+    AliasTable(std::vector<double> const& weights);
+
+    unsigned operator()(Philox& rng) const {
+        unsigned i = (std::uint64_t(rng())*keep.size()) >> 32;
+        return rng() < keep[i] ? i : alias[i];
+    }
+};
+
 /* Build PNKC connectivity matrix w in place, with glom choice weighted by cxnd
- * and drop_prop (see ModelParams). */
+ * and drop_prop (see ModelParams). The claw list is generated first (in
+ * parallel over KCs, each drawing from its own stream of (seed, replicate)),
+ * and w filled in from it. */
 void build_wPNKC_from_cxnd(
-        Matrix& w, unsigned nc, Row const& cxnd, double drop_prop);
+        Matrix& w, RunVars::KC::Claws& claws,
+        unsigned nc, Row const& cxnd, double drop_prop,
+        std::uint32_t seed, unsigned replicate);
+
+/* Rebuild the claw list from the nonzero entries of a dense wPNKC. */
+void build_claws_from_wPNKC(Matrix const& w, RunVars::KC::Claws& claws);
+
+/* Fingerprint of a wPNKC's shape and values, to tell when it has changed. */
+std::size_t wPNKC_fingerprint(Matrix const& w);
+
+/* Whether the claw list has been built for the current wPNKC. */
+bool claws_built(RunVars::KC const& kc);
+
+/* Rebuild the claw list from wPNKC if it was built for a different one. */
+void sync_claws(RunVars::KC& kc);
+
+/* The KC-side weights and thresholds, in the precision a KC kernel runs at
+ * (see ModelParams::KC::single_precision). */
+template<class T>
+struct KCWeights {
+    using Vec = Eigen::Matrix<T, Eigen::Dynamic, 1>;
+
+    /* Claw list; built here from the dense wPNKC if it is missing. */
+    RunVars::KC::Claws dense_claws;
+    unsigned n_claws;
+    unsigned const* gloms;
+    std::vector<T> claw_w;
+    /* Glomeruli of the claws of the selected KCs, if only some are kept. */
+    std::vector<unsigned> kept_gloms;
+
+    Vec thr;
+    Vec wAPLKC;
+    Vec wKCAPL;
+
+    /* Take the weights of all KCs, or only of those listed in kcs (in that
+     * order). */
+    KCWeights(RunVars::KC const& kc,
+            std::vector<unsigned> const* kcs = nullptr);
+};
+
+/* Calculate the PN input to each KC (i.e., wPNKC*pn) from the claw list. */
+template<class T>
+void kc_claw_input(KCWeights<T> const& w, T const* pn, T* out);
+
+/* Arguments to one fused KC timestep (see kc_step_kernel()). */
+template<class T>
+struct KCStep {
+    unsigned n;
+    T* Vm;
+    T const* in;     // PN input
+    T const* wAPLKC;
+    T const* thr;
+    T* peak;
+    T inh;           // APL activity
+    T ffapl;         // feedforward APL activity
+    T k;             // step_coef() for the KC membrane
+};
+template<class T>
+using KCStepKernel = void (*)(KCStep<T> const&, std::vector<unsigned>&);
+
+/* The best fused KC timestep for this CPU. A step integrates Vm (leak, PN
+ * drive, APL and feedforward inhibition), then thresholds, resets and
+ * updates the peak Vm, all in one pass over the KCs; the indices of the KCs
+ * that spiked are appended to the given list. */
+template<class T>
+KCStepKernel<T> kc_step_kernel();
+
+/* Arguments to one timestep of a batch of odors (see kc_lanes_kernel()). Each
+ * odor is a lane; per-KC state is lanes x KCs, and the PN activity lanes x
+ * glomeruli, so that the lanes of a KC or glomerulus are contiguous. */
+template<class T>
+struct KCLanesStep {
+    /* Lanes are padded to a multiple of this (one 64-byte vector). */
+    static constexpr unsigned align = 64/sizeof(T);
+
+    unsigned n;      // KCs
+    unsigned lanes;
+    unsigned nc;     // claws per KC
+    unsigned const* gloms;
+    T const* claw_w;
+    T const* pn;
+    T* Vm;
+    T* spikes;       // 1 where the KC spiked on this step, else 0
+    T* counts;
+    T* peak;
+    T const* wAPLKC;
+    T const* thr;
+    T const* inh;    // APL activity, per lane
+    T const* ffapl;  // feedforward APL activity, per lane
+    T k;             // step_coef() for the KC membrane
+};
+template<class T>
+using KCLanesKernel = void (*)(KCLanesStep<T> const&, std::vector<unsigned>&);
+
+/* The best batched KC timestep for this CPU: for every KC, the claw input
+ * (summed in the same order as kc_claw_input()) and then the fused step,
+ * across all lanes. The indices of the KCs that spiked in any lane are
+ * appended to the given list. */
+template<class T>
+KCLanesKernel<T> kc_lanes_kernel();
 
 /* Build wPNKC as specified by the ModelParams. */
 void build_wPNKC(ModelParams const& p, RunVars& rv);
+/* Same, into kc, drawing from the random streams of the given replicate.
+ * Does not log. */
+void build_wPNKC_kc(ModelParams const& p, RunVars::KC& kc, unsigned replicate);
+/* Same, into kc, logging to log. */
+void build_wPNKC_log(ModelParams const& p, RunVars::KC& kc, Logger& log);
+
+/* sim_KC_layer_stream and sim_KC_layer_batch, with the KC side taken from kc
+ * rather than rv.kc, and simulating only the KCs listed in kcs (all of them
+ * if null). The others are reported with no spikes and a peak Vm of 0.
+ * Recording requires all KCs. */
+void sim_KC_layer_stream_kcs(
+        ModelParams const& p, RunVars::KC const& kc,
+        Matrix const& pn_t, Vector const& ffapl_t,
+        std::vector<unsigned> const* kcs,
+        Column& spike_counts, Column& Vm_peak,
+        KCRecording const& rec = KCRecording());
+void sim_KC_layer_batch_kcs(
+        ModelParams const& p, UpstreamVars const& up, RunVars::KC const& kc,
+        std::vector<unsigned> const& odors,
+        std::vector<unsigned> const* kcs,
+        Matrix& spike_counts, Matrix& Vm_peaks);
+
+/* Parts of the KC model that the KC kernels can be compiled without, so that
+ * terms that cannot affect the result never enter the time loop. */
+unsigned const KC_DEPRESSION = 1; // vesicle depletion (ves_p != 0)
+unsigned const KC_FFAPL      = 2; // feedforward APL input
+unsigned const KC_APL        = 4; // APL feedback
+unsigned const KC_RECORD     = 8; // timecourse recording
+
+/* Decide which of the above a KC simulation needs. */
+unsigned kc_features(ModelParams const& p, RunVars::KC const& kc,
+        bool ffapl_nonzero, KCRecording const& rec);
+
+/* Lazily-updated KC vesicle pools. A pool only changes by more than its
+ * (closed-form) recovery on the step after its KC spikes, so each pool is
+ * stored as its value at the KC's last spike and brought up to date only
+ * when it is needed (i.e., when the KC spikes again). */
+template<class T>
+struct KCVesicles {
+    T k_r;           // step_coef() for vesicle recovery
+    T ves_p;
+    /* recovery[k] is the fraction of a pool's deficit left after k steps. */
+    std::vector<T> recovery;
+
+    KCVesicles(ModelParams const& p);
+    /* The pool at step t, given its value n at its KC's last spike (at step
+     * last, or -1 if the KC has not spiked). */
+    T at(T n, int last, unsigned t) const;
+};
+
+/* Bracketing root finder for the APL weight that gives the target sparsity
+ * (see ModelParams::KC::apl_tuner). Sparsity falls as the weight grows. */
+struct SparsityRootFinder {
+    double target;
+    /* The largest weight known to be too weak (sparsity above target) and the
+     * smallest known to be too strong, with their sparsity errors. */
+    bool have_lo, have_hi;
+    double lo, err_lo;
+    double hi, err_hi;
+    /* Which end was moved last (+1 for lo, -1 for hi); for Illinois steps. */
+    int last_moved;
+    /* The factor to grow/shrink by while bracketing. */
+    double growth;
+    /* The weight to try next when the too-weak end is not positive, since
+     * growing it would not move it. */
+    double floor;
+
+    SparsityRootFinder(double target, double floor);
+    /* Given the sparsity measured with weight w, choose the next weight. */
+    double next(double w, double sp);
+};
+
+/* A converged APL tuning, remembered for warm starts (see
+ * ModelParams::KC::warm_start). */
+struct WarmStart {
+    double wAPLKC;
+    double wKCAPL;
+    double sp;
+    /* Threshold statistics of the tuned model, for logging. */
+    double thr_mean;
+    double thr_sd;
+};
+
+/* Warm starts, keyed by tuning_fingerprint(). */
+std::mutex g_warm_starts_mtx;
+std::map<std::size_t, WarmStart> g_warm_starts;
+
+/* Hash every parameter that shapes the tuned model, leaving out seeds, the
+ * tuning method, and performance (time.quiescence_tol, pn.transfer,
+ * kc.streaming_thr, kc.odor_batch, kc.single_precision) and output options. */
+std::size_t tuning_fingerprint(ModelParams const& p);
+
+/* Look up/remember the warm start for p. */
+bool find_warm_start(ModelParams const& p, WarmStart& ws);
+void save_warm_start(ModelParams const& p, WarmStart const& ws);
 
 /* Sample spontaneous PN output from odor 0. */
-Column sample_PN_spont(ModelParams const& p, RunVars const& rv);
-
-/* Decide a KC threshold column from KC membrane voltage data. */
-Column choose_KC_thresh(
-        ModelParams const& p, Matrix& KCpks, Column const& spont_in);
+Column sample_PN_spont(ModelParams const& p, UpstreamVars const& up);
+
+/* Decide a KC threshold column from KC membrane voltage data (KCpks: peak Vm
+ * minus 2*spont_in, KCs x odors). These are called by every thread of a
+ * parallel region, and may reorder KCpks. */
+void choose_KC_thresh_uniform(ModelParams const& p,
+        Matrix& KCpks, Column const& spont_in, Column& thr);
+void choose_KC_thresh_homeostatic(ModelParams const& p,
+        Matrix& KCpks, Column const& spont_in, Column& thr);
+void choose_KC_thresh_mixed(ModelParams const& p,
+        Matrix& KCpks, Column const& spont_in, Column& thr);
+
+/* The rank (in decreasing order, from 0) of the peak that sets a threshold,
+ * out of n peaks. */
+std::size_t KC_thresh_rank(ModelParams const& p, std::size_t n);
+
+/* The value at the given rank (in decreasing order, from 0) of v[0..n).
+ * Called by every thread of a parallel region, which share the work. */
+double select_desc(double const* v, std::size_t n, std::size_t rank);
+
+/* Threshold selection that takes the KC peaks a block of odors at a time
+ * (see ModelParams::KC::streaming_thr). */
+struct KCThreshStream {
+    unsigned n_kcs;
+    std::size_t n_odors;
+    /* The largest KC_thresh_rank()+1 peaks of each KC so far, as a min-heap
+     * in each column (homeostatic thresholds only). */
+    Matrix top;
+    std::vector<unsigned> n_top;
+    /* Counts of all peaks, binned by their leading bits (see bin()), one
+     * histogram per thread (uniform thresholds only; each is allocated by its
+     * thread on first use). */
+    std::vector<std::vector<std::uint32_t>> hist;
+
+    /* Keep what uniform() and/or homeostatic() need. */
+    KCThreshStream(ModelParams const& p, std::size_t n_odors,
+            bool uniform, bool homeostatic);
+    /* Take the peaks of another block of odors (the first n columns of
+     * KCpks, KCs x odors). Called by every thread of a parallel region. */
+    void add(Matrix const& KCpks, unsigned n);
+    /* Thresholds of the given type, from all the peaks taken. */
+    Column uniform(ModelParams const& p, Column const& spont_in) const;
+    Column homeostatic(Column const& spont_in) const;
+
+    /* Histogram bins follow the order of the values; each spans 2^12 floats,
+     * i.e. 2^-11 of its value. */
+    static unsigned const BIN_SHIFT = 12;
+    static std::uint32_t bin(double v);
+    static double bin_floor(std::uint32_t b);
+};
+
+/* The state of one KC replicate while fit_sparseness_kcs() fits it. */
+struct KCFit {
+    RunVars::KC& kc;
+    /* Prefix for its log messages (empty when fitting just one). */
+    std::string tag;
+    Column spont_in;
+    /* Peak Vm less 2*spont_in (KCs x odors; only one block of odors when
+     * streaming thresholds). */
+    Matrix KCpks;
+    std::unique_ptr<KCThreshStream> thr_stream;
+    /* Odor responses of the last tuning pass (one column per tuning odor). */
+    Matrix KCmean_st;
+    /* Which KCs can still fire for each tuning odor (KCs x odors), once
+     * thresholds have been chosen; empty if that is not known. */
+    Eigen::Array<bool, Eigen::Dynamic, Eigen::Dynamic> can_fire;
+    /* The current sparsity. */
+    double sp;
+    /* State of the "root" tuner. */
+    SparsityRootFinder root;
+
+    KCFit(ModelParams const& p, RunVars::KC& kc, std::string const& tag);
+    /* The KCs that can fire for any of the n tuning odors from i on. */
+    std::vector<unsigned> active_kcs(unsigned i, unsigned n) const;
+};
+
+/* fit_sparseness, for several KC replicates (sharing the upstream sims in up)
+ * at once. */
+void fit_sparseness_kcs(ModelParams const& p, UpstreamVars const& up,
+        Logger& log, std::vector<RunVars::KC*> const& kcs);
+
+/* run_KC_sims, on the KC variables kc. */
+void run_KC_sims_kc(ModelParams const& p, UpstreamVars const& up,
+        RunVars::KC& kc, Logger& log, bool regen);
 
 /* Remove all columns <step in timecourse.*/
 void remove_before(unsigned step, Matrix& timecourse);
@@ -180,6 +719,9 @@ ModelParams::Time::Time(Time const& o) : stim(*this) {
     stim.start = o.stim.start;
     stim.end   = o.stim.end;
     dt         = o.dt;
+    integrator = o.integrator;
+    quiescence_tol = o.quiescence_tol;
+    solve_spont    = o.solve_spont;
 }
 ModelParams::Time::Stim::Stim(ModelParams::Time& o) : _owner(o) {
 }
@@ -212,19 +754,26 @@ Row ModelParams::Time::row_all() const {
     return ret;
 }
 
-RunVars::RunVars(ModelParams const& p) : orn(p), ln(p), pn(p), ffapl(p), kc(p) {
+UpstreamVars::UpstreamVars(ModelParams const& p) :
+    orn(p), ln(p), pn(p), ffapl(p) {
+}
+RunVars::RunVars(ModelParams const& p) : UpstreamVars(p), kc(p) {
 }
-RunVars::ORN::ORN(ModelParams const& p) :
+KCRunVars::KCRunVars(ModelParams const& p,
+        std::shared_ptr<UpstreamVars const> up) :
+    upstream(std::move(up)), kc(p) {
+}
+UpstreamVars::ORN::ORN(ModelParams const& p) :
     sims(get_nodors(p), Matrix(get_ngloms(p), p.time.steps_all())) {
 }
-RunVars::LN::LN(ModelParams const& p) :
+UpstreamVars::LN::LN(ModelParams const& p) :
     inhA{std::vector<Vector>(get_nodors(p), Row(1, p.time.steps_all()))},
     inhB{std::vector<Vector>(get_nodors(p), Row(1, p.time.steps_all()))} {
 }
-RunVars::PN::PN(ModelParams const& p) :
+UpstreamVars::PN::PN(ModelParams const& p) :
     sims(get_nodors(p), Matrix(get_ngloms(p), p.time.steps_all())) {
 }
-RunVars::FFAPL::FFAPL(ModelParams const& p) :
+UpstreamVars::FFAPL::FFAPL(ModelParams const& p) :
     vm_sims(get_nodors(p), Row(1, p.time.steps_all())),
     coef_sims(get_nodors(p), Row(1, p.time.steps_all())) {
     for (auto& v : vm_sims) {
@@ -235,16 +784,19 @@ RunVars::KC::KC(ModelParams const& p) :
     wPNKC(p.kc.N, get_ngloms(p)),
     wAPLKC(p.kc.N, 1),
     wKCAPL(1, p.kc.N),
+    claws{0, {}, {}, 0},
     // pks gets default initialized
     thr(p.kc.N, 1),
     responses(p.kc.N, get_nodors(p)),
     spike_counts(p.kc.N, get_nodors(p)),
+    /* (The prototypes are left empty when nothing is saved, since with many
+     * KCs even one would be huge.) */
     vm_sims(p.kc.save_vm_sims ? get_nodors(p) : 0,
-            Matrix(p.kc.N, p.time.steps_all())),
+            Matrix(p.kc.save_vm_sims ? p.kc.N : 0, p.time.steps_all())),
     spike_recordings(p.kc.save_spike_recordings ? get_nodors(p) : 0,
-            Matrix(p.kc.N, p.time.steps_all())),
+            Matrix(p.kc.save_spike_recordings ? p.kc.N : 0, p.time.steps_all())),
     nves_sims(p.kc.save_nves_sims ? get_nodors(p) : 0,
-            Matrix(p.kc.N, p.time.steps_all())),
+            Matrix(p.kc.save_nves_sims ? p.kc.N : 0, p.time.steps_all())),
     inh_sims(p.kc.save_inh_sims ? get_nodors(p) : 0,
             Matrix(1, p.time.steps_all())),
     Is_sims(p.kc.save_Is_sims ? get_nodors(p) : 0,
@@ -338,11 +890,162 @@ void smoothts_exp(Matrix& vin, double wsize) {
     }
 }
 
-void add_randomly(std::function<double()> rng, Matrix& out) {
-    for (unsigned i = 0; i < out.rows(); i++) {
-        for (unsigned j = 0; j < out.cols(); j++) {
-            out(i, j) += rng();
+Philox::Philox(std::uint32_t seed, std::uint32_t replicate,
+        std::uint32_t index, RNGLayer layer) :
+    ctr{0, 0, index, replicate}, key{seed, layer}, used(4) {
+}
+Philox::result_type Philox::operator()() {
+    if (used == 4) {
+        next_block();
+    }
+    return out[used++];
+}
+void Philox::next_block() {
+    blocks(out.data(), 1);
+    used = 0;
+}
+void Philox::blocks(std::uint32_t* dst, std::size_t n) {
+    std::uint32_t const M0 = 0xD2511F53, M1 = 0xCD9E8D57;
+    std::uint32_t const W0 = 0x9E3779B9, W1 = 0xBB67AE85;
+    /* The first two words count blocks; the others name the stream. */
+    std::uint64_t const first = ctr[0] | (std::uint64_t(ctr[1]) << 32);
+    std::uint32_t const c2 = ctr[2], c3 = ctr[3];
+    std::uint32_t const key0 = key[0], key1 = key[1];
+    /* Blocks are independent, so this vectorizes across them. */
+#pragma omp simd
+    for (std::size_t b = 0; b < n; b++) {
+        std::uint64_t c = first+b;
+        std::uint32_t x0 = std::uint32_t(c), x1 = std::uint32_t(c >> 32);
+        std::uint32_t x2 = c2, x3 = c3;
+        std::uint32_t k0 = key0, k1 = key1;
+        for (unsigned round = 0; round < 10; round++) {
+            std::uint64_t p0 = std::uint64_t(M0)*x0;
+            std::uint64_t p1 = std::uint64_t(M1)*x2;
+            x0 = std::uint32_t(p1 >> 32)^x1^k0;
+            x1 = std::uint32_t(p1);
+            x2 = std::uint32_t(p0 >> 32)^x3^k1;
+            x3 = std::uint32_t(p0);
+            k0 += W0;
+            k1 += W1;
+        }
+        dst[4*b]   = x0;
+        dst[4*b+1] = x1;
+        dst[4*b+2] = x2;
+        dst[4*b+3] = x3;
+    }
+    std::uint64_t const next = first+n;
+    ctr[0] = std::uint32_t(next);
+    ctr[1] = std::uint32_t(next >> 32);
+    used = 4;
+}
+std::uint32_t stream_seed(unsigned seed) {
+    return seed != 0 ? seed : g_randdev();
+}
+void fill_normal(Philox& rng, double mean, double sd,
+        double* out, unsigned n, std::vector<std::uint32_t>& scratch) {
+    /* One block (two 64-bit words) per pair of variates, whose cosine halves
+     * go to the front of out and sine halves to the back. */
+    unsigned const half = n/2;
+    unsigned const pairs = half + n%2;
+    scratch.resize(4*std::size_t(pairs));
+    rng.blocks(scratch.data(), pairs);
+    std::uint32_t const* bits = scratch.data();
+    double const TWO_PI = 6.283185307179586;
+    /* 53-bit uniforms; u1 in (0,1] so that its log is finite. */
+    auto uniform = [bits](unsigned w) {
+        std::uint64_t x = bits[2*w] | (std::uint64_t(bits[2*w+1]) << 32);
+        return double(std::int64_t(x >> 11))*0x1p-53;
+    };
+    auto u1 = [&](unsigned i) { return uniform(2*i)+0x1p-53; };
+    auto u2 = [&](unsigned i) { return uniform(2*i+1); };
+#pragma omp simd
+    for (unsigned i = 0; i < half; i++) {
+        double r = sd*std::sqrt(-2.0*std::log(u1(i)));
+        double theta = TWO_PI*u2(i);
+        /* sin(theta) written as a shifted cosine: a sin/cos pair of one
+         * argument gets fused into sincos, which has no vector variant. */
+        out[i]      = mean + r*std::cos(theta);
+        out[half+i] = mean + r*std::cos(theta - 0.25*TWO_PI);
+    }
+    if (n%2) {
+        out[n-1] = mean
+            + sd*std::sqrt(-2.0*std::log(u1(half)))*std::cos(TWO_PI*u2(half));
+    }
+}
+
+double step_coef(ModelParams const& p, double tau) {
+    return
+        p.time.integrator == "euler" ? p.time.dt/tau :
+        p.time.integrator == "exp" ? -std::expm1(-p.time.dt/tau) :
+        (abort(), 0.0);
+}
+
+Quiescence::Quiescence(ModelParams const& p, double tau) :
+        tol(p.time.quiescence_tol), scale(1.0/step_coef(p, tau)),
+        from(p.time.stim.end_step()), quiet(0) {
+}
+bool Quiescence::enabled() const {
+    return tol > 0.0;
+}
+bool Quiescence::operator()(unsigned t, double change, unsigned steps) {
+    if (t < from || !(change*scale < tol)) {
+        quiet = 0;
+        return false;
+    }
+    quiet += steps;
+    return quiet >= QUIESCENCE_STEPS;
+}
+
+TanhTable::TanhTable() {
+    /* One entry past XMAX, for interpolating right at the end. */
+    static std::vector<double> const table = [](){
+        std::vector<double> t(unsigned(XMAX*PER_UNIT)+2);
+        for (unsigned i = 0; i < t.size(); i++) {
+            t[i] = std::tanh(double(i)/PER_UNIT);
         }
+        return t;
+    }();
+    y = table.data();
+}
+
+double orn_settle_tau(ModelParams const& p) {
+    return std::max(p.orn.taum, 0.02); // see sim_ORN_layer's smoothing
+}
+double ln_settle_tau(ModelParams const& p) {
+    return std::max({orn_settle_tau(p), p.ln.taum, p.ln.tauGA, p.ln.tauGB});
+}
+double pn_settle_tau(ModelParams const& p) {
+    return std::max(ln_settle_tau(p), p.pn.taum);
+}
+double kc_settle_tau(ModelParams const& p) {
+    return std::max({pn_settle_tau(p), p.ffapl.taum,
+            p.kc.taum, p.kc.apl_taum, p.kc.tau_apl2kc});
+}
+
+unsigned spont_steps(ModelParams const& p) {
+    return p.time.solve_spont && p.time.stim.start >= p.time.start
+        ? p.time.start_step() : 0;
+}
+unsigned shared_prefix_steps(ModelParams const& p) {
+    unsigned const last = p.time.stim.start_step();
+    return p.pn.noise.sd == 0.0 && last < p.time.steps_all() ? last : 0;
+}
+void ln_fixed_point(ModelParams const& p, double orn_mean,
+        double& potential, double& response) {
+    /* At rest, inhA = inhB = response, and the potential sits at
+     * c*inhsc/(inhadd+response). With any response at all, response =
+     * potential-thr, which leaves a quadratic with one positive root. */
+    double const scaling = double(get_ngloms(p))/double(p.orn.n_physical_gloms);
+    double const x = orn_mean*scaling;
+    double const c = x*x*x/scaling/2.0;
+    double const thr = p.ln.thr;
+    double const inhadd = p.ln.inhadd;
+    potential = c*p.ln.inhsc/inhadd;
+    response = 0.0;
+    if (potential > thr) {
+        response = 0.5*(std::sqrt((inhadd-thr)*(inhadd-thr)
+                    + 4.0*c*p.ln.inhsc) - (thr+inhadd));
+        potential = response+thr;
     }
 }
 
@@ -400,49 +1103,371 @@ double ffapl_coef_lts(ModelParams const& p,
     return m + L*(1.0-m);
 }
 
+AliasTable::AliasTable(std::vector<double> const& weights) :
+    keep(weights.size()), alias(weights.size()) {
+    unsigned const n = weights.size();
+    double sum = 0.0;
+    for (double w : weights) sum += w;
+
+    /* Scale so that the average outcome fills exactly one slot, then pair
+     * each underfull slot with an overfull outcome to top it up. */
+    std::vector<double> scaled(n);
+    std::vector<unsigned> small, large;
+    for (unsigned i = 0; i < n; i++) {
+        scaled[i] = weights[i]*n/sum;
+        (scaled[i] < 1.0 ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        unsigned s = small.back(); small.pop_back();
+        unsigned l = large.back();
+        keep[s] = std::uint64_t(std::ldexp(scaled[s], 32));
+        alias[s] = l;
+        scaled[l] = (scaled[l]+scaled[s])-1.0;
+        if (scaled[l] < 1.0) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    /* Whatever is left is full (up to rounding). */
+    for (unsigned i : large) keep[i] = std::uint64_t(1) << 32, alias[i] = i;
+    for (unsigned i : small) keep[i] = std::uint64_t(1) << 32, alias[i] = i;
+}
+
 void build_wPNKC_from_cxnd(
-        Matrix& w, unsigned nc, Row const& cxnd, double drop_prop) {
-    w.setZero();
-    std::vector<double> flat(cxnd.size());
+        Matrix& w, RunVars::KC::Claws& claws,
+        unsigned nc, Row const& cxnd, double drop_prop,
+        std::uint32_t seed, unsigned replicate) {
+    unsigned const N = w.rows();
+    unsigned const ngloms = cxnd.size();
+
+    /* The last outcome is the drop bucket: a claw that lands there is left
+     * empty. */
+    std::vector<double> flat(ngloms);
     double sum = 0;
-    for (unsigned i = 0; i < cxnd.size(); i++) {
+    for (unsigned i = 0; i < ngloms; i++) {
         flat[i] = cxnd(0, i);
         sum += flat[i];
     }
     flat.push_back(drop_prop*sum/(1.0-drop_prop));
-    std::discrete_distribution<int> dd(flat.begin(), flat.end());
-    for (unsigned kc = 0; kc < w.rows(); kc++) {
-        for (unsigned claw = 0; claw < nc; claw++) {
-            int idx = dd(g_randgen);
-            if (idx < cxnd.size()) {
+    AliasTable const table(flat);
+
+    claws.n = nc;
+    claws.gloms.assign(std::size_t(N)*nc, 0);
+    claws.weights.assign(std::size_t(N)*nc, 0.0);
+    w.setZero();
+#pragma omp parallel for schedule(static)
+    for (unsigned kc = 0; kc < N; kc++) {
+        Philox rng(seed, replicate, kc, RNG_WPNKC);
+        for (std::size_t slot = std::size_t(kc)*nc;
+                slot < std::size_t(kc+1)*nc; slot++) {
+            unsigned idx = table(rng);
+            if (idx < ngloms) {
                 w(kc, idx) += 1.0;
+                claws.gloms[slot] = idx;
+                claws.weights[slot] = 1.0;
+            }
+        }
+    }
+}
+void build_claws_from_wPNKC(Matrix const& w, RunVars::KC::Claws& claws) {
+    unsigned nc = 0;
+    for (unsigned kc = 0; kc < w.rows(); kc++) {
+        nc = std::max(nc, unsigned((w.row(kc).array() != 0.0).count()));
+    }
+    claws.n = nc;
+    claws.gloms.assign(w.rows()*nc, 0);
+    claws.weights.assign(w.rows()*nc, 0.0);
+    for (unsigned kc = 0; kc < w.rows(); kc++) {
+        unsigned slot = kc*nc;
+        for (unsigned glom = 0; glom < w.cols(); glom++) {
+            if (w(kc, glom) != 0.0) {
+                claws.gloms[slot] = glom;
+                claws.weights[slot] = w(kc, glom);
+                slot++;
             }
         }
     }
+    claws.source = wPNKC_fingerprint(w);
 }
 void build_wPNKC(ModelParams const& p, RunVars& rv) {
-    if (p.kc.preset_wPNKC) return;
-    if (p.kc.seed != 0) {
-        g_randgen.seed(p.kc.seed);
+    build_wPNKC_log(p, rv.kc, rv.log);
+}
+void build_wPNKC(ModelParams const& p, KCRunVars& kv) {
+    build_wPNKC_log(p, kv.kc, kv.log);
+}
+void build_wPNKC_log(ModelParams const& p, RunVars::KC& kc, Logger& log) {
+    if (!p.kc.preset_wPNKC) {
+        log(p.kc.uniform_pns
+                ? "building UNIFORM connectivity matrix"
+                : "building WEIGHTED connectivity matrix");
+    }
+    build_wPNKC_kc(p, kc, 0);
+}
+void build_wPNKC_kc(ModelParams const& p, RunVars::KC& kc, unsigned replicate) {
+    if (p.kc.preset_wPNKC) {
+        build_claws_from_wPNKC(kc.wPNKC, kc.claws);
+        return;
     }
+    std::uint32_t seed = stream_seed(p.kc.seed);
     unsigned nc = p.kc.nclaws;
     double pdp = p.kc.pn_drop_prop;
     if (p.kc.uniform_pns) {
-        rv.log("building UNIFORM connectivity matrix");
         Row cxnd(1, get_ngloms(p));
         cxnd.setOnes();
-        build_wPNKC_from_cxnd(rv.kc.wPNKC, nc, cxnd, pdp);
+        build_wPNKC_from_cxnd(kc.wPNKC, kc.claws, nc, cxnd, pdp,
+                seed, replicate);
     }
     else {
-        rv.log("building WEIGHTED connectivity matrix");
-        build_wPNKC_from_cxnd(rv.kc.wPNKC, nc, p.kc.cxn_distrib, pdp);
+        build_wPNKC_from_cxnd(kc.wPNKC, kc.claws, nc, p.kc.cxn_distrib, pdp,
+                seed, replicate);
     }
     if (p.kc.currents.size()) {
-        rv.kc.wPNKC *= p.kc.currents.asDiagonal();
-        //rv.kc.wPNKC = rv.kc.wPNKC.array().colwise() * p.kc.currents.array();
+        kc.wPNKC *= p.kc.currents.asDiagonal();
+        //kc.wPNKC = kc.wPNKC.array().colwise() * p.kc.currents.array();
+        for (unsigned i = 0; i < kc.claws.weights.size(); i++) {
+            kc.claws.weights[i] *= p.kc.currents(kc.claws.gloms[i]);
+        }
+    }
+    kc.claws.source = wPNKC_fingerprint(kc.wPNKC);
+}
+
+bool claws_built(RunVars::KC const& kc) {
+    return !kc.claws.gloms.empty()
+        && kc.claws.gloms.size()
+            == std::size_t(kc.claws.n)*std::size_t(kc.wPNKC.rows())
+        && kc.claws.source == wPNKC_fingerprint(kc.wPNKC);
+}
+void sync_claws(RunVars::KC& kc) {
+    if (!claws_built(kc)) {
+        build_claws_from_wPNKC(kc.wPNKC, kc.claws);
+    }
+}
+template<class T>
+KCWeights<T>::KCWeights(RunVars::KC const& kc,
+        std::vector<unsigned> const* kcs) {
+    RunVars::KC::Claws const* src = &kc.claws;
+    if (!claws_built(kc)) {
+        build_claws_from_wPNKC(kc.wPNKC, dense_claws);
+        src = &dense_claws;
+    }
+    n_claws = src->n;
+    if (!kcs) {
+        gloms = src->gloms.data();
+        claw_w.assign(src->weights.begin(), src->weights.end());
+        thr = kc.thr.cast<T>();
+        wAPLKC = kc.wAPLKC.cast<T>();
+        wKCAPL = kc.wKCAPL.transpose().cast<T>();
+        return;
+    }
+
+    unsigned const n = kcs->size();
+    kept_gloms.resize(n*n_claws);
+    claw_w.resize(n*n_claws);
+    thr.resize(n);
+    wAPLKC.resize(n);
+    wKCAPL.resize(n);
+    for (unsigned i = 0; i < n; i++) {
+        unsigned const kc_i = (*kcs)[i];
+        for (unsigned c = 0; c < n_claws; c++) {
+            kept_gloms[i*n_claws+c] = src->gloms[kc_i*n_claws+c];
+            claw_w[i*n_claws+c] = src->weights[kc_i*n_claws+c];
+        }
+        thr(i) = kc.thr(kc_i);
+        wAPLKC(i) = kc.wAPLKC(kc_i);
+        wKCAPL(i) = kc.wKCAPL(kc_i);
+    }
+    gloms = kept_gloms.data();
+}
+
+/* Sum the claw inputs of each KC; unrolled for a compile-time claw count. */
+template<class T, unsigned NC>
+void kc_claw_gather(unsigned const* g, T const* w,
+        T const* pn, T* out, unsigned n_kcs) {
+    for (unsigned kc = 0; kc < n_kcs; kc++, g += NC, w += NC) {
+        T acc = 0.0;
+        for (unsigned c = 0; c < NC; c++) {
+            acc += w[c]*pn[g[c]];
+        }
+        out[kc] = acc;
+    }
+}
+/* Same as above, for any claw count. */
+template<class T>
+void kc_claw_gather(unsigned nc, unsigned const* g, T const* w,
+        T const* pn, T* out, unsigned n_kcs) {
+    for (unsigned kc = 0; kc < n_kcs; kc++, g += nc, w += nc) {
+        T acc = 0.0;
+        for (unsigned c = 0; c < nc; c++) {
+            acc += w[c]*pn[g[c]];
+        }
+        out[kc] = acc;
     }
 }
-Column sample_PN_spont(ModelParams const& p, RunVars const& rv) {
+template<class T>
+void kc_claw_input(KCWeights<T> const& w, T const* pn, T* out) {
+    unsigned const* g = w.gloms;
+    T const* cw = w.claw_w.data();
+    unsigned const n = w.thr.size();
+    switch (w.n_claws) {
+    case 1: kc_claw_gather<T, 1>(g, cw, pn, out, n); break;
+    case 2: kc_claw_gather<T, 2>(g, cw, pn, out, n); break;
+    case 3: kc_claw_gather<T, 3>(g, cw, pn, out, n); break;
+    case 4: kc_claw_gather<T, 4>(g, cw, pn, out, n); break;
+    case 5: kc_claw_gather<T, 5>(g, cw, pn, out, n); break;
+    case 6: kc_claw_gather<T, 6>(g, cw, pn, out, n); break;
+    case 7: kc_claw_gather<T, 7>(g, cw, pn, out, n); break;
+    case 8: kc_claw_gather<T, 8>(g, cw, pn, out, n); break;
+    default: kc_claw_gather<T>(w.n_claws, g, cw, pn, out, n);
+    }
+}
+SparsityRootFinder::SparsityRootFinder(double target_, double floor_) :
+        target(target_), have_lo(false), have_hi(false),
+        lo(0.0), err_lo(0.0), hi(0.0), err_hi(0.0), last_moved(0),
+        growth(2.0), floor(floor_) {
+}
+
+template<class T>
+void hash_into(std::size_t& h, T const& v) {
+    h ^= std::hash<T>()(v) + 0x9e3779b97f4a7c15ull + (h<<6) + (h>>2);
+}
+template<class Derived>
+void hash_values_into(std::size_t& h, Eigen::DenseBase<Derived> const& m) {
+    hash_into(h, std::size_t(m.rows()));
+    hash_into(h, std::size_t(m.cols()));
+    for (Eigen::Index j = 0; j < m.cols(); j++) {
+        for (Eigen::Index i = 0; i < m.rows(); i++) {
+            hash_into(h, double(m(i, j)));
+        }
+    }
+}
+std::size_t wPNKC_fingerprint(Matrix const& w) {
+    /* Checked on every KC sim, so this mixes the raw bits in four independent
+     * lanes rather than going through hash_values_into(). */
+    std::uint64_t lanes[4] = {1, 2, 3, 4};
+    std::size_t const n = w.size();
+    double const* v = w.data();
+    std::size_t i = 0;
+    for (; i+4 <= n; i += 4) {
+        for (unsigned k = 0; k < 4; k++) {
+            std::uint64_t bits;
+            std::memcpy(&bits, v+i+k, sizeof bits);
+            lanes[k] = (lanes[k]^bits)*0x9e3779b97f4a7c15ull;
+        }
+    }
+    for (; i < n; i++) {
+        std::uint64_t bits;
+        std::memcpy(&bits, v+i, sizeof bits);
+        lanes[0] = (lanes[0]^bits)*0x9e3779b97f4a7c15ull;
+    }
+    std::size_t h = 0;
+    hash_into(h, std::size_t(w.rows()));
+    hash_into(h, std::size_t(w.cols()));
+    for (std::uint64_t l : lanes) hash_into(h, std::size_t(l));
+    return h;
+}
+std::size_t tuning_fingerprint(ModelParams const& p) {
+    std::size_t h = 0;
+    hash_into(h, p.time.pre_start);
+    hash_into(h, p.time.start);
+    hash_into(h, p.time.end);
+    hash_into(h, p.time.stim.start);
+    hash_into(h, p.time.stim.end);
+    hash_into(h, p.time.dt);
+    hash_into(h, p.time.integrator);
+    hash_into(h, p.time.solve_spont);
+
+    hash_into(h, p.orn.taum);
+    hash_into(h, p.orn.n_physical_gloms);
+    hash_values_into(h, p.orn.data.spont);
+    hash_values_into(h, p.orn.data.delta);
+
+    hash_into(h, p.ln.taum);
+    hash_into(h, p.ln.tauGA);
+    hash_into(h, p.ln.tauGB);
+    hash_into(h, p.ln.thr);
+    hash_into(h, p.ln.inhsc);
+    hash_into(h, p.ln.inhadd);
+
+    hash_into(h, p.pn.taum);
+    hash_into(h, p.pn.offset);
+    hash_into(h, p.pn.tanhsc);
+    hash_into(h, p.pn.inhsc);
+    hash_into(h, p.pn.inhadd);
+    hash_into(h, p.pn.noise.mean);
+    hash_into(h, p.pn.noise.sd);
+
+    hash_into(h, p.kc.N);
+    hash_into(h, p.kc.nclaws);
+    hash_into(h, p.kc.uniform_pns);
+    hash_values_into(h, p.kc.cxn_distrib);
+    hash_into(h, p.kc.pn_drop_prop);
+    hash_into(h, p.kc.preset_wPNKC);
+    hash_values_into(h, p.kc.currents);
+    hash_into(h, p.kc.ignore_ffapl);
+    hash_into(h, p.kc.fixed_thr);
+    hash_into(h, p.kc.add_fixed_thr_to_spont);
+    hash_into(h, p.kc.use_fixed_thr);
+    hash_into(h, p.kc.use_homeostatic_thrs);
+    hash_into(h, p.kc.thr_type);
+    hash_into(h, p.kc.sp_target);
+    for (unsigned i : p.kc.tune_from) hash_into(h, i);
+    hash_into(h, p.kc.apltune_subsample);
+    hash_into(h, p.kc.taum);
+    hash_into(h, p.kc.apl_taum);
+    hash_into(h, p.kc.tau_apl2kc);
+    hash_into(h, p.kc.tau_r);
+    hash_into(h, p.kc.ves_p);
+
+    hash_into(h, p.ffapl.taum);
+    hash_into(h, p.ffapl.w);
+    hash_into(h, p.ffapl.coef);
+    hash_into(h, p.ffapl.zero);
+    hash_into(h, p.ffapl.nneg);
+    hash_into(h, p.ffapl.gini.a);
+    hash_into(h, p.ffapl.gini.source);
+    hash_into(h, p.ffapl.lts.m);
+    return h;
+}
+bool find_warm_start(ModelParams const& p, WarmStart& ws) {
+    std::size_t key = tuning_fingerprint(p);
+    std::lock_guard<std::mutex> lock(g_warm_starts_mtx);
+    auto it = g_warm_starts.find(key);
+    if (it == g_warm_starts.end()) return false;
+    ws = it->second;
+    return true;
+}
+void save_warm_start(ModelParams const& p, WarmStart const& ws) {
+    std::size_t key = tuning_fingerprint(p);
+    std::lock_guard<std::mutex> lock(g_warm_starts_mtx);
+    g_warm_starts[key] = ws;
+}
+void clear_warm_starts() {
+    std::lock_guard<std::mutex> lock(g_warm_starts_mtx);
+    g_warm_starts.clear();
+}
+double SparsityRootFinder::next(double w, double sp) {
+    double err = sp - target;
+    bool bracketed = have_lo && have_hi;
+    if (err > 0.0) {
+        have_lo = true;
+        lo = w; err_lo = err;
+        if (bracketed && last_moved == +1) err_hi /= 2.0;
+        last_moved = +1;
+    }
+    else {
+        have_hi = true;
+        hi = w; err_hi = err;
+        if (bracketed && last_moved == -1) err_lo /= 2.0;
+        last_moved = -1;
+    }
+
+    /* Grow/shrink geometrically until the target is bracketed. */
+    if (!have_hi) return lo > 0.0 ? growth*lo : floor;
+    if (!have_lo) return hi/growth;
+    return lo + err_lo*(hi-lo)/(err_lo-err_hi);
+}
+
+Column sample_PN_spont(ModelParams const& p, UpstreamVars const& up) {
     /* Sample from halfway between time start and stim start to stim start. */
     unsigned sp_t1 =
         p.time.start_step()
@@ -450,113 +1475,231 @@ Column sample_PN_spont(ModelParams const& p, RunVars const& rv) {
     unsigned sp_t2 =
         p.time.start_step()
         + unsigned((p.time.stim.start-p.time.start)/(p.time.dt));
-    return rv.pn.sims[0].block(0,sp_t1,get_ngloms(p),sp_t2-sp_t1).rowwise().mean();
-}
-Column choose_KC_thresh_uniform(
-        ModelParams const& p, Matrix& KCpks, Column const& spont_in) {
-    unsigned tlist_sz = KCpks.cols();
-    KCpks.resize(1, KCpks.size());                     // flatten
-    std::sort(KCpks.data(), KCpks.data()+KCpks.size(),
-            [](double a, double b){return a>b;});      // dec. order
-    double thr_const = KCpks(std::min(
-                int(p.kc.sp_target*2.0*double(p.kc.N*tlist_sz)),
-                int(p.kc.N*tlist_sz)-1));
-    return thr_const + spont_in.array()*2.0;
-}
-Column choose_KC_thresh_homeostatic(
-        ModelParams const& p, Matrix& KCpks, Column const& spont_in) {
+    return up.pn.sims[0].block(0,sp_t1,get_ngloms(p),sp_t2-sp_t1).rowwise().mean();
+}
+std::size_t KC_thresh_rank(ModelParams const& p, std::size_t n) {
+    return std::min(std::size_t(p.kc.sp_target*2.0*double(n)), n-1);
+}
+double select_desc(double const* v, std::size_t n, std::size_t rank) {
+    /* Radix select on the bits of the values (flipped so that they sort as
+     * unsigned integers), 8 bits per pass. Each pass counts the values that
+     * match the bits chosen so far in per-thread histograms, which are merged
+     * once, and every thread then picks the same next 8 bits. */
+    auto key = [](double x) {
+        std::uint64_t u;
+        std::memcpy(&u, &x, sizeof(u));
+        return (u >> 63) ? ~u : (u | (std::uint64_t(1) << 63));
+    };
+    std::vector<std::size_t>* counts;
+#pragma omp single copyprivate(counts)
+    counts = new std::vector<std::size_t>(8*256, 0);
+
+    std::uint64_t prefix = 0, mask = 0;
+    for (int pass = 0, shift = 56; pass < 8; pass++, shift -= 8) {
+        std::size_t* merged = counts->data() + 256*pass;
+        std::size_t local[256] = {0};
+#pragma omp for schedule(static) nowait
+        for (std::size_t i = 0; i < n; i++) {
+            std::uint64_t k = key(v[i]);
+            if ((k & mask) == prefix) local[(k >> shift) & 0xff]++;
+        }
+        for (unsigned b = 0; b < 256; b++) {
+            if (local[b]) {
+#pragma omp atomic
+                merged[b] += local[b];
+            }
+        }
+#pragma omp barrier
+        unsigned b = 255;
+        for (; b > 0 && rank >= merged[b]; b--) rank -= merged[b];
+        prefix |= std::uint64_t(b) << shift;
+        mask |= std::uint64_t(0xff) << shift;
+    }
+#pragma omp barrier
+#pragma omp single
+    delete counts;
+
+    std::uint64_t u = (prefix >> 63) ? (prefix & ~(std::uint64_t(1) << 63))
+                                     : ~prefix;
+    double x;
+    std::memcpy(&x, &u, sizeof(x));
+    return x;
+}
+void choose_KC_thresh_uniform(ModelParams const& p,
+        Matrix& KCpks, Column const& spont_in, Column& thr) {
+    /* Only the one peak at the threshold rank is needed, so select it rather
+     * than sorting everything. */
+    double pk = select_desc(KCpks.data(), KCpks.size(),
+            KC_thresh_rank(p, KCpks.size()));
+#pragma omp single
+    {
+        thr = pk + spont_in.array()*2.0;
+    }
+}
+void choose_KC_thresh_homeostatic(ModelParams const& p,
+        Matrix& KCpks, Column const& spont_in, Column& thr) {
     /* Basically do the same procedure as the uniform algorithm, but do it for
-     * each KC (row) separately instead of all together.
-     * To sort each row in place, we first flatten the entire list, and then
-     * sort portions of it in place. This is an unfortunate consequence of the
-     * lack of stl iterators in Eigen <=3.4. */
-    Column thr = 2.0*spont_in;
+     * each KC (row) separately instead of all together. KCpks itself is left
+     * as it is. */
     unsigned cols = KCpks.cols();
-    unsigned wanted = p.kc.sp_target*2.0*double(cols);
-    KCpks.transposeInPlace();
-    KCpks.resize(1, KCpks.size());
-    /* Choose a threshold for each KC by inspecting its sorted responses. */
+    std::size_t rank = KC_thresh_rank(p, cols);
+#pragma omp single
+    {
+        thr = 2.0*spont_in;
+    }
+    std::vector<double> row(cols);
+#pragma omp for schedule(static)
     for (unsigned i = 0; i < p.kc.N; i++) {
-        unsigned offset = i*cols;
-        std::sort(KCpks.data()+offset, KCpks.data()+offset+cols,
+        for (unsigned j = 0; j < cols; j++) row[j] = KCpks(i, j);
+        std::nth_element(row.begin(), row.begin()+rank, row.end(),
                 std::greater<double>());
-        thr(i) += KCpks(offset+wanted);
+        thr(i) += row[rank];
     }
-    return thr;
 }
-Column choose_KC_thresh_mixed(
-        ModelParams const& p, Matrix& KCpks, Column const& spont_in) {
+void choose_KC_thresh_mixed(ModelParams const& p,
+        Matrix& KCpks, Column const& spont_in, Column& thr) {
     /* Just average uniform and homeostatic thresholding. */
-    // choose_KC_thresh_X methods mess with KCpks, so we have to give them each
-    // their own.
-    Matrix& KCpks1 = KCpks;
-    Matrix KCpks2 = KCpks;
-    Column uniform = choose_KC_thresh_uniform(p, KCpks1, spont_in);
-    Column hstatic = choose_KC_thresh_homeostatic(p, KCpks2, spont_in);
-    return (uniform+hstatic)/2.0;
+    choose_KC_thresh_homeostatic(p, KCpks, spont_in, thr);
+    double pk = select_desc(KCpks.data(), KCpks.size(),
+            KC_thresh_rank(p, KCpks.size()));
+#pragma omp single
+    {
+        Column uniform = pk + spont_in.array()*2.0;
+        thr = (uniform+thr)/2.0;
+    }
+}
+
+KCThreshStream::KCThreshStream(ModelParams const& p, std::size_t n_odors_,
+        bool uniform, bool homeostatic) :
+        n_kcs(p.kc.N), n_odors(n_odors_),
+        top(homeostatic ? KC_thresh_rank(p, n_odors_)+1 : 0, p.kc.N),
+        n_top(p.kc.N, 0),
+        hist(uniform ? omp_get_max_threads() : 0) {
+}
+void KCThreshStream::add(Matrix const& KCpks, unsigned n_new) {
+    unsigned const cap = top.rows();
+    std::uint32_t* h = nullptr;
+    if (hist.size()) {
+        std::vector<std::uint32_t>& mine = hist[omp_get_thread_num()];
+        if (mine.empty()) mine.assign(std::size_t(1) << (32-BIN_SHIFT), 0);
+        h = mine.data();
+    }
+#pragma omp for schedule(static)
+    for (unsigned i = 0; i < n_kcs; i++) {
+        if (h) {
+            for (unsigned j = 0; j < n_new; j++) h[bin(KCpks(i, j))]++;
+        }
+        if (!cap) continue;
+        double* heap = &top(0, i);
+        unsigned& n = n_top[i];
+        for (unsigned j = 0; j < n_new; j++) {
+            double v = KCpks(i, j);
+            if (n < cap) {
+                heap[n++] = v;
+                std::push_heap(heap, heap+n, std::greater<double>());
+            }
+            else if (v > heap[0]) {
+                std::pop_heap(heap, heap+n, std::greater<double>());
+                heap[n-1] = v;
+                std::push_heap(heap, heap+n, std::greater<double>());
+            }
+        }
+    }
+}
+Column KCThreshStream::uniform(
+        ModelParams const& p, Column const& spont_in) const {
+    /* Walk down from the highest bin to the one holding the peak at the
+     * threshold rank, and take the lowest value that bin can hold. */
+    std::size_t rank = KC_thresh_rank(p, std::size_t(n_kcs)*n_odors);
+    std::size_t seen = 0;
+    std::uint32_t b = (std::size_t(1) << (32-BIN_SHIFT)) - 1;
+    for (; b > 0; b--) {
+        for (auto const& h : hist) {
+            if (h.size()) seen += h[b];
+        }
+        if (seen > rank) break;
+    }
+    return bin_floor(b) + spont_in.array()*2.0;
+}
+Column KCThreshStream::homeostatic(Column const& spont_in) const {
+    /* Each heap's smallest entry is that KC's peak at the threshold rank. */
+    Column thr = 2.0*spont_in;
+    for (unsigned i = 0; i < n_kcs; i++) {
+        thr(i) += top(0, i);
+    }
+    return thr;
+}
+std::uint32_t KCThreshStream::bin(double v) {
+    /* Flip the bits of a float so that they sort as unsigned integers in the
+     * same order as the values. */
+    float f = v;
+    std::uint32_t u;
+    std::memcpy(&u, &f, sizeof(u));
+    u = (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+    return u >> BIN_SHIFT;
+}
+double KCThreshStream::bin_floor(std::uint32_t b) {
+    std::uint32_t u = b << BIN_SHIFT;
+    u = (u & 0x80000000u) ? (u & 0x7fffffffu) : ~u;
+    float f;
+    std::memcpy(&f, &u, sizeof(f));
+    return f;
+}
+KCFit::KCFit(ModelParams const& p, RunVars::KC& kc_, std::string const& tag_) :
+        kc(kc_), tag(tag_),
+        /* Initially set to the below value because, given default model
+         * parameters, it causes tuning to complete in just one iteration. */
+        sp(0.0789),
+        /* (Bracketing from a zero weight starts at the cold-start one.) */
+        root(p.kc.sp_target, 2*ceil(-std::log(p.kc.sp_target))) {
+}
+std::vector<unsigned> KCFit::active_kcs(unsigned i, unsigned n) const {
+    std::vector<unsigned> kcs;
+    for (unsigned kc = 0; kc < can_fire.rows(); kc++) {
+        if (can_fire.block(kc, i, 1, n).any()) kcs.push_back(kc);
+    }
+    return kcs;
 }
 void fit_sparseness(ModelParams const& p, RunVars& rv) {
-    rv.log("fitting sparseness");
+    fit_sparseness_kcs(p, rv, rv.log, {&rv.kc});
+}
+void fit_sparseness(ModelParams const& p, KCRunVars& kv) {
+    fit_sparseness_kcs(p, *kv.upstream, kv.log, {&kv.kc});
+}
+void fit_sparseness_kcs(ModelParams const& p, UpstreamVars const& up,
+        Logger& log, std::vector<RunVars::KC*> const& kcs) {
+    log("fitting sparseness");
+    /* wPNKC may have been edited since it was last built. */
+    for (RunVars::KC* kc : kcs) sync_claws(*kc);
 
     std::vector<unsigned> tlist = p.kc.tune_from;
     if (!tlist.size()) {
         for (unsigned i = 0; i < get_nodors(p); i++) tlist.push_back(i);
     }
 
-    /* Calculate spontaneous input to KCs. */
-    Column spont_in = rv.kc.wPNKC * sample_PN_spont(p, rv);
-    rv.kc.spont_in = spont_in;
-
-    /* Set starting values for the things we'll tune. */
-    // TODO matter? seems to be overwritten below in this case anyway...
-    // (and put inside this conditional to avoid overwriting values set in python, via
-    // pybind11)
-    if (p.kc.tune_apl_weights) {
-        // TODO if this is helping, and i also need in other case, maybe set wAPLKC and
-        // wKCAPL via new entries in ModelParams, after initial calls that would use
-        // them below (and still initialize like this, unconditionally, up here)?
-        //
-        // TODO delete? resetting just below anyway...
-        // or did i really need these up top where i moved them from (why?)?
-        // (didn't want to overwrite values when passing in, but could make a
-        // conditional up there)
-        rv.kc.wAPLKC.setZero();
-        rv.kc.wKCAPL.setConstant(1.0/float(p.kc.N));
-
-        // TODO in an else statement, check that wAPLKC and wKCAPL are appropriately
-        // initialized?
-    }
-    if (!p.kc.use_fixed_thr) {
-        rv.kc.thr.setConstant(1e5); // higher than will ever be reached
+    /* Whether to simulate odors in batches (see sim_KC_layer_batch). */
+    unsigned const batch = std::max(p.kc.odor_batch, 1u);
+    auto batch_at = [batch](std::vector<unsigned> const& odors, unsigned i) {
+        return std::vector<unsigned>(
+                odors.begin()+i,
+                odors.begin()+std::min<std::size_t>(i+batch, odors.size()));
+    };
+    /* When streaming thresholds, the peaks are only kept for one block of
+     * odors at a time (a whole number of batches, enough to share among the
+     * threads). */
+    unsigned thr_block = tlist.size();
+    if (p.kc.streaming_thr) {
+        thr_block = batch*std::max(unsigned(omp_get_max_threads()), 64/batch);
+        thr_block = std::min<std::size_t>(thr_block, tlist.size());
     }
-    else {
-        rv.log(cat("using FIXED threshold: ", p.kc.fixed_thr));
-        if (p.kc.add_fixed_thr_to_spont) {
-            // TODO delete + replace w/ similar commented line below
-            // (after confirming the 2 things w/ factor 2 cancel out...)
-            rv.log("adding fixed threshold to 2 * spontaneous PN input to each KC");
-            //rv.log("adding fixed threshold to spontaneous PN input to each KC");
 
-            rv.kc.thr = p.kc.fixed_thr + spont_in.array()*2.0;
-        } else {
-            rv.kc.thr.setConstant(p.kc.fixed_thr);
-        }
+    /* The odors used to estimate sparsity during APL tuning (one per column of
+     * KCFit::KCmean_st). */
+    std::vector<unsigned> tsub;
+    for (unsigned i = 0; i < tlist.size(); i+=p.kc.apltune_subsample) {
+        tsub.push_back(tlist[i]);
     }
 
-    /* Used for measuring KC voltage; defined here to make it shared across all
-     * threads.*/
-    Matrix KCpks(p.kc.N, tlist.size()); KCpks.setZero();
-
-    /* Used to store odor response data during APL tuning. */
-    Matrix KCmean_st(p.kc.N, 1+((tlist.size()-1)/p.kc.apltune_subsample));
-    /* Used to store the current sparsity.
-     * Initially set to the below value because, given default model
-     * parameters, it causes tuning to complete in just one iteration. */
-    double sp = 0.0789;
-    /* Used to count number of times looped; the 'learning rate' is decreased
-     * as 1/sqrt(count) with each iteration. */
-    rv.kc.tuning_iters = 0;
-
     unsigned const TTFIXED = 1;
     unsigned const TTHSTATIC = 2;
     unsigned const TTMIXED = 3;
@@ -574,394 +1717,1716 @@ void fit_sparseness(ModelParams const& p, RunVars& rv) {
             tt == "mixed" ? TTMIXED :
             tt == "fixed" ? TTFIXED :
         (abort(), TTINVALID);
+    bool const root_tuner =
+        p.kc.apl_tuner == "root" ? true :
+        p.kc.apl_tuner == "lr" ? false :
+        (abort(), false);
+
+    /* Spontaneous PN output, which all the replicates share. */
+    Column spont_pn = sample_PN_spont(p, up);
+
+    unsigned const R = kcs.size();
+    std::vector<KCFit> fits;
+    fits.reserve(R);
+    auto flog = [&log](KCFit const& f, std::string const& msg) {
+        log(f.tag + msg);
+    };
+    for (unsigned r = 0; r < R; r++) {
+        fits.emplace_back(p, *kcs[r],
+                R > 1 ? cat("replicate ", r, ": ") : std::string());
+        KCFit& f = fits.back();
+        RunVars::KC& kc = f.kc;
+
+        /* Calculate spontaneous input to KCs. */
+        f.spont_in = kc.wPNKC * spont_pn;
+        kc.spont_in = f.spont_in;
+
+        /* Set starting values for the things we'll tune. */
+        // TODO matter? seems to be overwritten below in this case anyway...
+        // (and put inside this conditional to avoid overwriting values set in python, via
+        // pybind11)
+        if (p.kc.tune_apl_weights) {
+            // TODO if this is helping, and i also need in other case, maybe set wAPLKC and
+            // wKCAPL via new entries in ModelParams, after initial calls that would use
+            // them below (and still initialize like this, unconditionally, up here)?
+            //
+            // TODO delete? resetting just below anyway...
+            // or did i really need these up top where i moved them from (why?)?
+            // (didn't want to overwrite values when passing in, but could make a
+            // conditional up there)
+            kc.wAPLKC.setZero();
+            kc.wKCAPL.setConstant(1.0/float(p.kc.N));
+
+            // TODO in an else statement, check that wAPLKC and wKCAPL are appropriately
+            // initialized?
+        }
+        if (!p.kc.use_fixed_thr) {
+            kc.thr.setConstant(1e5); // higher than will ever be reached
+        }
+        else {
+            flog(f, cat("using FIXED threshold: ", p.kc.fixed_thr));
+            if (p.kc.add_fixed_thr_to_spont) {
+                // TODO delete + replace w/ similar commented line below
+                // (after confirming the 2 things w/ factor 2 cancel out...)
+                flog(f, "adding fixed threshold to 2 * spontaneous PN input to each KC");
+                //flog(f, "adding fixed threshold to spontaneous PN input to each KC");
+
+                kc.thr = p.kc.fixed_thr + f.spont_in.array()*2.0;
+            } else {
+                kc.thr.setConstant(p.kc.fixed_thr);
+            }
+        }
+
+        if (p.kc.streaming_thr) {
+            f.thr_stream.reset(new KCThreshStream(p, tlist.size(),
+                        thrtype != TTHSTATIC, thrtype != TTUNIFORM));
+        }
+        f.KCpks.setZero(p.kc.N, thr_block);
+        f.KCmean_st.resize(p.kc.N, tsub.size());
+
+        /* Used to count number of times looped; the 'learning rate' is
+         * decreased as 1/sqrt(count) with each iteration. */
+        kc.tuning_iters = 0;
+        kc.tuning_w.clear();
+        kc.tuning_sp.clear();
+    }
+    /* The replicates whose APL weights are still being tuned. */
+    std::vector<unsigned> tuning;
 
-    /* Break up into threads. */
+    /* Break up into threads. Every pass over the odors is shared out over
+     * (replicate, batch of odors) pairs, so that there is enough work to go
+     * around even with few odors. */
 #pragma omp parallel
     {
-        /* Output matrices for the KC simulation. */
-        Matrix Vm(p.kc.N, p.time.steps_all());
-        Matrix spikes(p.kc.N, p.time.steps_all());
-        Matrix nves(p.kc.N, p.time.steps_all());
-        Row inh(1, p.time.steps_all());
-        Row Is(1, p.time.steps_all());
+        /* Output of the KC simulation (one column per odor if batching). */
+        Matrix counts, peaks;
 
         if (thrtype != TTFIXED) {
-#pragma omp single
+#pragma omp single nowait
             {
-                rv.log("choosing thresholds from spontaneous input");
+                log("choosing thresholds from spontaneous input");
             }
 
             /* Measure voltages achieved by the KCs, and choose a threshold
              * based on that. */
-#pragma omp for
-            for (unsigned i = 0; i < tlist.size(); i++) {
-                sim_KC_layer(p, rv,
-                        rv.pn.sims[tlist[i]], rv.ffapl.vm_sims[tlist[i]],
-                        Vm, spikes, nves, inh, Is);
-#pragma omp critical
-                KCpks.col(i) = Vm.rowwise().maxCoeff() - spont_in*2.0;
+            for (unsigned from = 0; from < tlist.size(); from += thr_block) {
+                unsigned to = std::min<std::size_t>(from+thr_block,
+                        tlist.size());
+                unsigned const per_fit = (to-from+batch-1)/batch;
+#pragma omp for schedule(dynamic)
+                for (unsigned job = 0; job < R*per_fit; job++) {
+                    KCFit& f = fits[job/per_fit];
+                    unsigned i = from + (job%per_fit)*batch;
+                    if (batch > 1) {
+                        sim_KC_layer_batch_kcs(p, up, f.kc,
+                                batch_at(tlist, i), nullptr,
+                                counts, peaks);
+                        for (unsigned b = 0; b < peaks.cols(); b++) {
+                            f.KCpks.col(i-from+b) =
+                                peaks.col(b) - f.spont_in*2.0;
+                        }
+                    }
+                    else {
+                        sim_KC_layer_stream_kcs(p, f.kc,
+                                up.pn.sims[tlist[i]], up.ffapl.vm_sims[tlist[i]],
+                                nullptr, counts, peaks);
+                        f.KCpks.col(i-from) = peaks - f.spont_in*2.0;
+                    }
+                }
+                for (KCFit& f : fits) {
+                    if (f.thr_stream) {
+                        f.thr_stream->add(f.KCpks, to-from);
+                    }
+                }
             }
 
+            for (KCFit& f : fits) {
+                if (f.thr_stream) continue;
 #pragma omp single
-            {
-                rv.kc.pks = KCpks;
-                /*for (unsigned w = 0; w < rv.kc.pks.rows(); w++) {
-                    for (unsigned z = 0; z < rv.kc.pks.cols(); z++) {
-                        if (rv.kc.pks(w,z) < -1e20) abort();
-                    }
-                }*/
+                {
+                    f.kc.pks = f.KCpks;
+                    /*for (unsigned w = 0; w < f.kc.pks.rows(); w++) {
+                        for (unsigned z = 0; z < f.kc.pks.cols(); z++) {
+                            if (f.kc.pks(w,z) < -1e20) abort();
+                        }
+                    }*/
+                }
 
                 /* Finish picking thresholds. */
-                rv.kc.thr =
-                    (thrtype == TTHSTATIC ? choose_KC_thresh_homeostatic :
-                     thrtype == TTMIXED ? choose_KC_thresh_mixed :
-                     choose_KC_thresh_uniform)
-                    (p, KCpks, spont_in);
+                (thrtype == TTHSTATIC ? choose_KC_thresh_homeostatic :
+                 thrtype == TTMIXED ? choose_KC_thresh_mixed :
+                 choose_KC_thresh_uniform)
+                (p, f.KCpks, f.spont_in, f.kc.thr);
+            }
+
+#pragma omp single
+            for (KCFit& f : fits) {
+                RunVars::KC& kc = f.kc;
+                if (f.thr_stream) {
+                    kc.pks.resize(0, 0);
+                    kc.thr =
+                        thrtype == TTHSTATIC ?
+                            f.thr_stream->homeostatic(f.spont_in) :
+                        thrtype == TTMIXED ?
+                            Column((f.thr_stream->uniform(p, f.spont_in)
+                                    + f.thr_stream->homeostatic(f.spont_in))/2.0) :
+                            f.thr_stream->uniform(p, f.spont_in);
+                }
+
+                /* The APL can only lower Vm, so a KC whose uninhibited peak
+                 * stayed under threshold for an odor will not fire for it
+                 * with any APL weights, and (never driving the APL) can be
+                 * left out of tuning entirely. The slack covers rounding. */
+                if (p.kc.tune_apl_weights && !f.thr_stream) {
+                    f.can_fire.resize(p.kc.N, tsub.size());
+                    for (unsigned j = 0; j < tsub.size(); j++) {
+                        unsigned col = j*p.kc.apltune_subsample;
+                        f.can_fire.col(j) =
+                            (kc.pks.col(col) + f.spont_in*2.0).array()
+                            > kc.thr.array() - 1e-4*kc.thr.array().abs();
+                    }
+                    flog(f, cat("tuning with ", f.can_fire.count(), " of ",
+                                f.can_fire.size(), " KC-odor pairs able to fire"));
+                }
             }
         }
 
         /* Enter this region only if APL use is enabled; if disabled, just exit
          * (at this point APL->KC weights are set to 0). */
         if (p.kc.tune_apl_weights) {
+        auto within_acc = [&p](double sp) {
+            return std::abs(sp-p.kc.sp_target)
+                <= p.kc.sp_acc*p.kc.sp_target;
+        };
+        /* Modify the APL<->KC weights in order to move in the direction of
+         * the target sparsity ("lr" tuner). */
+        auto lr_step = [&](KCFit& f) {
+            RunVars::KC& kc = f.kc;
+            double lr = p.kc.sp_lr_coeff/sqrt(double(kc.tuning_iters));
+            double delta = (f.sp-p.kc.sp_target)*lr/p.kc.sp_target;
+            kc.wAPLKC.array() += delta;
+            kc.wKCAPL.array() += delta/double(p.kc.N);
+
+            /* If we learn too fast in the negative direction we could end
+             * up with negative weights. */
+            if (delta < 0.0) {
+                kc.wAPLKC = (kc.wAPLKC.array() < 0.0).select(
+                        0.0, kc.wAPLKC);
+                kc.wKCAPL = (kc.wKCAPL.array() < 0.0).select(
+                        0.0, kc.wKCAPL);
+            }
+
+            flog(f, cat( "* i=", kc.tuning_iters,
+                        ", sp=", f.sp,
+                        ", wAPLKC_delta=", delta,
+                        ", lr=", lr));
+
+            kc.tuning_iters++;
+        };
+
 #pragma omp single
         {
             // TODO fucked version seems to have this block more indented. problem?
-            rv.log(cat("tuning APL<->KC weights; tuning begin (",
+            log(cat("tuning APL<->KC weights; tuning begin (",
                         "target=", p.kc.sp_target,
                         " acc=", p.kc.sp_acc,
                         ")"));
 
-            rv.kc.tuning_iters = 1;
-            /* Starting values for to-be-tuned APL<->KC weights. */
-            rv.kc.wAPLKC.setConstant(
-                    2*ceil(-log(p.kc.sp_target)));
-            rv.kc.wKCAPL.setConstant(
-                    2*ceil(-log(p.kc.sp_target))/double(p.kc.N));
-        }
-
-        // TODO did change in indentation on this do (and enclosed block) matter?
-        /* Continue tuning until we reach the desired sparsity. */
-        do {
-            //rv.log(cat("** t", omp_get_thread_num(), " @ top"));
-#pragma omp barrier
-
-#pragma omp single
-            {
-                /* Modify the APL<->KC weights in order to move in the
-                 * direction of the target sparsity. */
-                double lr = p.kc.sp_lr_coeff/sqrt(double(rv.kc.tuning_iters));
-                double delta = (sp-p.kc.sp_target)*lr/p.kc.sp_target;
-                rv.kc.wAPLKC.array() += delta;
-                rv.kc.wKCAPL.array() += delta/double(p.kc.N);
-
-                /* If we learn too fast in the negative direction we could end
-                 * up with negative weights. */
-                if (delta < 0.0) {
-                    rv.kc.wAPLKC = (rv.kc.wAPLKC.array() < 0.0).select(
-                            0.0, rv.kc.wAPLKC);
-                    rv.kc.wKCAPL = (rv.kc.wKCAPL.array() < 0.0).select(
-                            0.0, rv.kc.wKCAPL);
+            WarmStart ws;
+            bool warm = p.kc.warm_start && find_warm_start(p, ws);
+            for (unsigned r = 0; r < R; r++) {
+                KCFit& f = fits[r];
+                RunVars::KC& kc = f.kc;
+                kc.tuning_iters = 1;
+                /* Starting values for to-be-tuned APL<->KC weights. */
+                kc.wAPLKC.setConstant(
+                        2*ceil(-std::log(p.kc.sp_target)));
+                kc.wKCAPL.setConstant(
+                        2*ceil(-std::log(p.kc.sp_target))/double(p.kc.N));
+
+                if (warm) {
+                    flog(f, cat("warm start from wAPLKC=", ws.wAPLKC,
+                                " (sp=", ws.sp,
+                                ", thr mean=", ws.thr_mean,
+                                ", thr sd=", ws.thr_sd, ")"));
+                    kc.wAPLKC.setConstant(ws.wAPLKC);
+                    kc.wKCAPL.setConstant(ws.wKCAPL);
+                    /* The first "lr" step then leaves the weights alone, and
+                     * the "root" tuner only has to look close by. */
+                    f.sp = p.kc.sp_target;
+                    f.root.growth = 1.25;
                 }
 
-                rv.log(cat( "* i=", rv.kc.tuning_iters,
-                            ", sp=", sp,
-                            ", wAPLKC_delta=", delta,
-                            ", lr=", lr));
-
-                rv.kc.tuning_iters++;
+                if (!root_tuner) {
+                    lr_step(f);
+                }
+                tuning.push_back(r);
             }
+        }
 
-            //rv.log(cat("** t", omp_get_thread_num(), " @ before testing"));
-            /* Run through a bunch of odors to test sparsity. */
-#pragma omp for
-            for (unsigned i = 0; i < tlist.size(); i+=p.kc.apltune_subsample) {
-                sim_KC_layer(p, rv,
-                        rv.pn.sims[tlist[i]], rv.ffapl.vm_sims[tlist[i]],
-                        Vm, spikes, nves, inh, Is);
-                KCmean_st.col(i/p.kc.apltune_subsample) = spikes.rowwise().sum();
+        /* Run each replicate still being tuned through a bunch of odors to
+         * test sparsity, then on one thread record it and call decide(),
+         * which returns whether that replicate is done and otherwise picks
+         * its next weights. Each round thus has just two barriers (after the
+         * odors and after deciding), and the list of replicates being tuned
+         * is only changed once every thread is done reading it. */
+        auto measure_sparsity = [&](auto&& decide) {
+            unsigned const per_fit = (tsub.size()+batch-1)/batch;
+#pragma omp for schedule(dynamic)
+            for (unsigned job = 0; job < tuning.size()*per_fit; job++) {
+                KCFit& f = fits[tuning[job/per_fit]];
+                unsigned i = (job%per_fit)*batch;
+                if (batch > 1) {
+                    std::vector<unsigned> odors = batch_at(tsub, i);
+                    std::vector<unsigned> kcs = f.active_kcs(i, odors.size());
+                    sim_KC_layer_batch_kcs(p, up, f.kc, odors,
+                            f.can_fire.size() ? &kcs : nullptr,
+                            counts, peaks);
+                    f.KCmean_st.middleCols(i, counts.cols()) = counts;
+                }
+                else {
+                    std::vector<unsigned> kcs = f.active_kcs(i, 1);
+                    sim_KC_layer_stream_kcs(p, f.kc,
+                            up.pn.sims[tsub[i]], up.ffapl.vm_sims[tsub[i]],
+                            f.can_fire.size() ? &kcs : nullptr,
+                            counts, peaks);
+                    f.KCmean_st.col(i) = counts;
+                }
             }
-            //rv.log(cat("** t", omp_get_thread_num(), " @ after testing"));
 
 #pragma omp single
             {
-                KCmean_st = (KCmean_st.array() > 0.0).select(1.0, KCmean_st);
-                sp = KCmean_st.mean();
-            }
-
-            rv.log(cat("** t", omp_get_thread_num(), " @ before bottom cond [",
-                        "sp=", sp,
-                        ", i=", rv.kc.tuning_iters,
-                        ", tgt=", p.kc.sp_target,
-                        ", acc=", p.kc.sp_acc,
-                        ", I=", p.kc.max_iters,
-                        "]"));
-        } while ((abs(sp-p.kc.sp_target)>(p.kc.sp_acc*p.kc.sp_target))
-                && (rv.kc.tuning_iters <= p.kc.max_iters));
-        //rv.log(cat("** t", omp_get_thread_num(), " @ exit"));
-#pragma omp barrier
-#pragma omp single
-        {
-            rv.kc.tuning_iters--;
+                std::vector<unsigned> still_tuning;
+                for (unsigned r : tuning) {
+                    KCFit& f = fits[r];
+                    f.KCmean_st =
+                        (f.KCmean_st.array() > 0.0).select(1.0, f.KCmean_st);
+                    f.sp = f.KCmean_st.mean();
+                    f.kc.tuning_w.push_back(f.kc.wAPLKC.mean());
+                    f.kc.tuning_sp.push_back(f.sp);
+                    if (!decide(f)) still_tuning.push_back(r);
+                }
+                tuning.swap(still_tuning);
+            }
+        };
+
+        if (root_tuner) {
+            do {
+                measure_sparsity([&](KCFit& f) {
+                    RunVars::KC& kc = f.kc;
+                    double w = kc.wAPLKC.mean();
+                    bool tuned = within_acc(f.sp)
+                        || kc.tuning_iters >= p.kc.max_iters;
+                    if (!tuned) {
+                        w = f.root.next(w, f.sp);
+                        kc.wAPLKC.setConstant(w);
+                        kc.wKCAPL.setConstant(w/double(p.kc.N));
+                        kc.tuning_iters++;
+                    }
+                    flog(f, cat( "* i=", kc.tuning_iters,
+                                ", sp=", f.sp,
+                                tuned ? ", done, wAPLKC=" : ", next wAPLKC=", w,
+                                ", bracket=[", f.root.lo, ", ", f.root.hi, "]"));
+                    return tuned;
+                });
+            } while (!tuning.empty());
+        }
+        else {
+            /* Continue tuning until we reach the desired sparsity. */
+            do {
+                measure_sparsity([&](KCFit& f) {
+                    bool tuned = within_acc(f.sp)
+                        || f.kc.tuning_iters > p.kc.max_iters;
+                    if (tuned) {
+                        f.kc.tuning_iters--;
+                    }
+                    else {
+                        lr_step(f);
+                    }
+                    return tuned;
+                });
+            } while (!tuning.empty());
         }
     }}
-    rv.log("done fitting sparseness");
-}
 
-void sim_ORN_layer(
-        ModelParams const& p, RunVars const& rv,
-        int odorid,
-        Matrix& orn_t) {
-    /* Initialize with spontaneous activity. */
-    orn_t = p.orn.data.spont*p.time.row_all();
+    for (KCFit const& f : fits) {
+        RunVars::KC const& kc = f.kc;
+        if (p.kc.tune_apl_weights && p.kc.warm_start
+                && std::abs(f.sp-p.kc.sp_target) <= p.kc.sp_acc*p.kc.sp_target) {
+            double thr_mean = kc.thr.mean();
+            save_warm_start(p, {
+                    kc.wAPLKC.mean(), kc.wKCAPL.mean(), f.sp,
+                    thr_mean,
+                    std::sqrt((kc.thr.array()-thr_mean).square().mean())});
+        }
+    }
+    log("done fitting sparseness");
+}
 
+ORNStimResponse::ORNStimResponse(ModelParams const& p) {
     /* "Odor input to ORNs" (Kennedy comment)
      * Smoothed timeseries of spont...odor rate...spont */
-    Matrix odor = orn_t + p.orn.data.delta.col(odorid)*p.time.stim.row_all();
-    smoothts_exp(odor, 0.02/p.time.dt); // where does 0.02 come from!?
+    input = p.time.stim.row_all();
+    smoothts_exp(input, 0.02/p.time.dt); // where does 0.02 come from!?
 
-    double mul = p.time.dt/p.orn.taum;
+    /* The ORNs start at spont, whatever the input. */
+    double mul = step_coef(p, p.orn.taum);
+    response.resize(1, p.time.steps_all());
+    response(0) = 0.0;
     for (unsigned t = 1; t < p.time.steps_all(); t++) {
-        orn_t.col(t) = orn_t.col(t-1)*(1.0-mul) + odor.col(t)*mul;
+        response(t) = response(t-1)*(1.0-mul) + input(t)*mul;
+    }
+}
+unsigned ORNStimResponse::active_steps(
+        ModelParams const& p, double dmax) const {
+    /* The largest per-step change is dmax times the change in the response
+     * or the input. */
+    Quiescence quiescent(p, orn_settle_tau(p));
+    if (quiescent.enabled()) {
+        for (unsigned t = 1; t < p.time.steps_all(); t++) {
+            if (quiescent(t, dmax*std::max(
+                        std::abs(response(t)-response(t-1)),
+                        std::abs(input(t)-input(t-1))))) {
+                return t+1;
+            }
+        }
     }
+    return p.time.steps_all();
+}
+void sim_ORN_layer(
+        ModelParams const& p, RunVars const& /*rv*/,
+        int odorid,
+        Matrix& orn_t) {
+    sim_ORN_layer_from(p, ORNStimResponse(p), odorid, orn_t);
+}
+unsigned sim_ORN_layer_from(
+        ModelParams const& p, ORNStimResponse const& stim,
+        int odorid,
+        Matrix& orn_t) {
+    unsigned const steps = p.time.steps_all();
+    auto const& spont = p.orn.data.spont;
+    auto const& delta = p.orn.data.delta.col(odorid);
+
+    unsigned const held = stim.active_steps(p, delta.cwiseAbs().maxCoeff());
+    orn_t.resize(spont.rows(), steps);
+    for (unsigned t = 0; t < held; t++) {
+        orn_t.col(t) = spont + stim.response(t)*delta;
+    }
+    if (held < steps) {
+        orn_t.rightCols(steps-held).colwise() = orn_t.col(held-1);
+    }
+    return held;
 }
 void sim_LN_layer(
         ModelParams const& p,
         Matrix const& orn_t,
         Row& inhA, Row& inhB) {
-    Row potential(1, p.time.steps_all()); potential.setConstant(300.0);
-    Row response(1, p.time.steps_all());  response.setOnes();
-    inhA.setConstant(50.0);
-    inhB.setConstant(50.0);
-    double inh_LN = 0.0;
-
-    double dinhAdt, dinhBdt, dLNdt;
-    double scaling = double(get_ngloms(p))/double(p.orn.n_physical_gloms);
-    for (unsigned t = 1; t < p.time.steps_all(); t++) {
-        dinhAdt = -inhA(t-1) + response(t-1);
-        dinhBdt = -inhB(t-1) + response(t-1);
-        dLNdt =
-            -potential(t-1)
-            +pow(orn_t.col(t-1).mean()*scaling, 3.0)/scaling/2.0*inh_LN;
-        inhA(t) = inhA(t-1) + dinhAdt*p.time.dt/p.ln.tauGA;
-        inhB(t) = inhB(t-1) + dinhBdt*p.time.dt/p.ln.tauGB;
-        inh_LN = p.ln.inhsc/(p.ln.inhadd+inhA(t));
-        potential(t) = potential(t-1) + dLNdt*p.time.dt/p.ln.taum;
-        //response(t) = potential(t) > lnp.thr ? potential(t)-lnp.thr : 0.0;
-        response(t) = (potential(t)-p.ln.thr)*double(potential(t)>p.ln.thr);
+    sim_LN_layer_batch(p, orn_t.colwise().mean(), inhA, inhB);
+}
+void sim_LN_layer_batch(
+        ModelParams const& p,
+        Matrix const& orn_mean,
+        Matrix& inhA, Matrix& inhB,
+        LNPrefix const* prefix,
+        std::vector<double>* potential_end) {
+    unsigned const B = orn_mean.rows();
+    unsigned const steps = orn_mean.cols();
+    inhA.resize(B, steps);
+    inhB.resize(B, steps);
+    inhA.col(0).setConstant(50.0);
+    inhB.col(0).setConstant(50.0);
+
+    /* Per-odor state, one lane each. */
+    std::vector<double> potential(B, 300.0);
+    std::vector<double> response(B, 1.0);
+    std::vector<double> inh_LN(B, 0.0);
+    std::vector<double> change(B);
+
+    double const scaling = double(get_ngloms(p))/double(p.orn.n_physical_gloms);
+    double const kA  = step_coef(p, p.ln.tauGA);
+    double const kB  = step_coef(p, p.ln.tauGB);
+    double const kLN = step_coef(p, p.ln.taum);
+    double const thr = p.ln.thr;
+    double const inhsc = p.ln.inhsc;
+    double const inhadd = p.ln.inhadd;
+
+    /* Fork from the shared prefix, or start at rest if asked to (see
+     * ModelParams::Time::solve_spont). The response and inhibition that go
+     * into the next step follow from the potential and inhA. */
+    unsigned t0 = spont_steps(p);
+    if (prefix) {
+        t0 = prefix->inhA.cols()-1;
+        for (unsigned b = 0; b < B; b++) {
+            inhA.row(b).head(t0+1) = prefix->inhA;
+            inhB.row(b).head(t0+1) = prefix->inhB;
+            potential[b] = prefix->potential;
+            response[b] = (potential[b]-thr)*double(potential[b]>thr);
+            inh_LN[b] = inhsc/(inhadd+inhA(b, t0));
+        }
+    }
+    else if (t0 > 0) {
+        for (unsigned b = 0; b < B; b++) {
+            ln_fixed_point(p, orn_mean(b, t0), potential[b], response[b]);
+            inhA.row(b).head(t0+1).setConstant(response[b]);
+            inhB.row(b).head(t0+1).setConstant(response[b]);
+            inh_LN[b] = inhsc/(inhadd+response[b]);
+        }
+    }
+
+    /* An odor that settles early stops being recorded (held[b] is how many
+     * steps it got); its lane just idles along until the batch is done. */
+    std::vector<Quiescence> quiescent(B, Quiescence(p, ln_settle_tau(p)));
+    std::vector<unsigned> held(B, steps);
+    unsigned running = B;
+    for (unsigned t = t0+1; t < steps && running; t++) {
+        double const* orn = orn_mean.data() + std::size_t(t-1)*B;
+        double const* A0 = inhA.data() + std::size_t(t-1)*B;
+        double const* B0 = inhB.data() + std::size_t(t-1)*B;
+        double* A = inhA.data() + std::size_t(t)*B;
+        double* Bt = inhB.data() + std::size_t(t)*B;
+        double* pot = potential.data();
+        double* resp = response.data();
+        double* inh = inh_LN.data();
+        double* dx = change.data();
+#pragma omp simd
+        for (unsigned b = 0; b < B; b++) {
+            double const dinhAdt = -A0[b] + resp[b];
+            double const dinhBdt = -B0[b] + resp[b];
+            double const x = orn[b]*scaling;
+            double const dLNdt = -pot[b] + x*x*x/scaling/2.0*inh[b];
+            A[b]  = A0[b] + dinhAdt*kA;
+            Bt[b] = B0[b] + dinhBdt*kB;
+            inh[b] = inhsc/(inhadd+A[b]);
+            double const next = pot[b] + dLNdt*kLN;
+            dx[b] = std::max({std::abs(next-pot[b]),
+                    std::abs(A[b]-A0[b]), std::abs(Bt[b]-B0[b])});
+            pot[b] = next;
+            resp[b] = (next-thr)*double(next>thr);
+        }
+
+        if (quiescent[0].enabled()) {
+            for (unsigned b = 0; b < B; b++) {
+                if (held[b] == steps && quiescent[b](t, change[b])) {
+                    held[b] = t+1;
+                    running--;
+                }
+            }
+        }
+    }
+    for (unsigned b = 0; b < B; b++) {
+        if (held[b] < steps) {
+            inhA.row(b).tail(steps-held[b]).setConstant(inhA(b, held[b]-1));
+            inhB.row(b).tail(steps-held[b]).setConstant(inhB(b, held[b]-1));
+        }
+    }
+    if (potential_end) {
+        *potential_end = potential;
     }
 }
-void sim_PN_layer(
-        ModelParams const& p, RunVars const& rv,
+LNPrefix::LNPrefix(ModelParams const& p, unsigned last) {
+    /* Before the stimulus, every odor's mean ORN rate is spont's. */
+    Matrix orn_mean =
+        Matrix::Constant(1, last+1, p.orn.data.spont.mean());
+    std::vector<double> end;
+    sim_LN_layer_batch(p, orn_mean, inhA, inhB, nullptr, &end);
+    potential = end[0];
+}
+/* sim_PN_layer, with the given transfer function standing in for tanh. */
+template<class Tanh>
+void sim_PN_layer_as(
+        ModelParams const& p,
+        int odorid,
         Matrix const& orn_t, Row const& inhA, Row const& inhB,
-        Matrix& pn_t) {
-    std::normal_distribution<double> noise(p.pn.noise.mean, p.pn.noise.sd);
+        Matrix& pn_t, Tanh const& transfer, Matrix const* prefix) {
+    unsigned const ngloms = get_ngloms(p);
+    unsigned const steps = orn_t.cols();
 
     Column spont  = p.orn.data.spont*p.pn.inhsc/(p.orn.data.spont.sum()+p.pn.inhadd);
-    pn_t          = p.orn.data.spont*p.time.row_all();
+    pn_t.resize(ngloms, steps);
+    pn_t.col(0)   = p.orn.data.spont;
     double inh_PN = 0.0;
 
-    Column orn_delta;
-    Column dPNdt;
-    for (unsigned t = 1; t < p.time.steps_all(); t++) {
-        orn_delta = orn_t.col(t-1)-p.orn.data.spont;
-        dPNdt = -pn_t.col(t-1) + spont;
-        dPNdt +=
-            200.0*((orn_delta.array()+p.pn.offset)*p.pn.tanhsc/200.0*inh_PN).matrix().unaryExpr<double(*)(double)>(&tanh);
-        add_randomly([&noise](){return noise(g_randgen);}, dPNdt);
+    /* Noise is drawn a whole step at a time, into the one buffer. Without
+     * any, it is just the (constant) mean. */
+    bool const noisy = p.pn.noise.sd != 0.0;
+    Philox rng(stream_seed(p.pn.noise.seed), 0, odorid, RNG_PN_NOISE);
+    Column noise_t = Column::Constant(ngloms, 1, p.pn.noise.mean);
+    std::vector<std::uint32_t> noise_scratch;
+
+    /* Noise never lets the PNs settle. */
+    Quiescence quiescent(p, pn_settle_tau(p));
+    if (noisy) quiescent.tol = 0.0;
+
+    double const kPN = step_coef(p, p.pn.taum);
+    double const offset = p.pn.offset;
+    double const tanhsc = p.pn.tanhsc;
+    double const* orn_spont = p.orn.data.spont.data();
+    double const* pn_spont = spont.data();
+    double const* nz = noise_t.data();
+
+    /* Fork from the shared prefix, or start at rest if asked to (see
+     * ModelParams::Time::solve_spont): each PN where its noiseless drive
+     * balances the leak. */
+    unsigned t0 = spont_steps(p);
+    if (prefix) {
+        t0 = prefix->cols()-1;
+        pn_t.leftCols(t0+1) = *prefix;
+        inh_PN = p.pn.inhsc/(p.pn.inhadd+0.25*inhA(t0)+0.75*inhB(t0));
+    }
+    else if (t0 > 0) {
+        inh_PN = p.pn.inhsc/(p.pn.inhadd+0.25*inhA(t0)+0.75*inhB(t0));
+        Column rest(ngloms, 1);
+        for (unsigned g = 0; g < ngloms; g++) {
+            double pn = pn_spont[g] + p.pn.noise.mean
+                + 200.0*transfer((orn_t(g, t0)-orn_spont[g]+offset)*tanhsc/200.0*inh_PN);
+            rest(g) = 0.0 < pn ? pn : 0.0;
+        }
+        pn_t.leftCols(t0+1) = rest.replicate(1, t0+1);
+    }
+
+    for (unsigned t = t0+1; t < steps; t++) {
+        if (noisy) {
+            fill_normal(rng, p.pn.noise.mean, p.pn.noise.sd,
+                    noise_t.data(), ngloms, noise_scratch);
+        }
+
+        /* One pass over the glomeruli, with nothing allocated; the compiler
+         * vectorizes it, the transfer function included (for libm's tanh,
+         * where the math library allows). */
+        double const* orn = orn_t.data() + std::size_t(t-1)*ngloms;
+        double const* prev = pn_t.data() + std::size_t(t-1)*ngloms;
+        double* cur = pn_t.data() + std::size_t(t)*ngloms;
+        double change = 0.0;
+#pragma omp simd reduction(max:change)
+        for (unsigned g = 0; g < ngloms; g++) {
+            double dPNdt = -prev[g] + pn_spont[g]
+                + 200.0*transfer((orn[g]-orn_spont[g]+offset)*tanhsc/200.0*inh_PN)
+                + nz[g];
+            double pn = prev[g] + dPNdt*kPN;
+            pn = 0.0 < pn ? pn : 0.0;
+            cur[g] = pn;
+            change = std::max(change, std::abs(pn-prev[g]));
+        }
 
         inh_PN = p.pn.inhsc/(p.pn.inhadd+0.25*inhA(t)+0.75*inhB(t));
-        pn_t.col(t) = pn_t.col(t-1) + dPNdt*p.time.dt/p.pn.taum;
-        pn_t.col(t) = (0.0 < pn_t.col(t).array()).select(pn_t.col(t), 0.0);
+
+        if (quiescent.enabled() && quiescent(t, change)) {
+            pn_t.rightCols(steps-t-1).colwise() = pn_t.col(t);
+            break;
+        }
     }
 }
+void sim_PN_layer(
+        ModelParams const& p, RunVars const& /*rv*/,
+        int odorid,
+        Matrix const& orn_t, Row const& inhA, Row const& inhB,
+        Matrix& pn_t) {
+    sim_PN_layer_from(p, odorid, orn_t, inhA, inhB, pn_t, nullptr);
+}
+void sim_PN_layer_from(
+        ModelParams const& p,
+        int odorid,
+        Matrix const& orn_t, Row const& inhA, Row const& inhB,
+        Matrix& pn_t, Matrix const* prefix) {
+    std::string const& tf = p.pn.transfer;
+    tf == "tanh" ?
+        sim_PN_layer_as(p, odorid, orn_t, inhA, inhB, pn_t,
+                TanhLibm(), prefix) :
+    tf == "rational" ?
+        sim_PN_layer_as(p, odorid, orn_t, inhA, inhB, pn_t,
+                TanhRational(), prefix) :
+    tf == "table" ?
+        sim_PN_layer_as(p, odorid, orn_t, inhA, inhB, pn_t,
+                TanhTable(), prefix) :
+    abort();
+}
 void sim_FFAPL_layer(
         ModelParams const& p, RunVars const& rv,
         Matrix const& pn_t,
         Vector& ffapl_t, Vector& coef_t) {
+    //Column pn_spont = p.orn.data.spont*p.pn.inhsc/(p.orn.data.spont.sum()+p.pn.inhadd);
+    sim_FFAPL_layer_from(p, sample_PN_spont(p, rv), pn_t, ffapl_t, coef_t,
+            nullptr);
+}
+void sim_FFAPL_layer_from(
+        ModelParams const& p, Column const& pn_spont,
+        Matrix const& pn_t,
+        Vector& ffapl_t, Vector& coef_t,
+        FFAPLPrefix const* prefix) {
     ffapl_t.setZero();
     coef_t.setZero();
 
-    //Column pn_spont = p.orn.data.spont*p.pn.inhsc/(p.orn.data.spont.sum()+p.pn.inhadd);
-    Column pn_spont = sample_PN_spont(p, rv);
+    unsigned t0 = 0;
+    if (prefix) {
+        t0 = prefix->vm.cols()-1;
+        ffapl_t.leftCols(t0+1) = prefix->vm;
+        coef_t.leftCols(t0+1) = prefix->coef;
+    }
+    integrate_FFAPL(p, pn_spont, pn_t, ffapl_t, coef_t,
+            t0, p.time.steps_all());
 
+    double spont = ffapl_t(p.time.stim.start_step()-1);
+    if (p.ffapl.nneg) {
+        ffapl_t = (spont < ffapl_t.array()).select(ffapl_t, spont);
+    }
+    if (p.ffapl.zero) {
+        ffapl_t = ffapl_t.array() - spont;
+    }
+}
+void integrate_FFAPL(ModelParams const& p, Column const& pn_spont,
+        Matrix const& pn_t, Vector& ffapl_t, Vector& coef_t,
+        unsigned t0, unsigned t1) {
     double (*coef_calc)(ModelParams const&, Column const&, Column const&);
     coef_calc =
         p.ffapl.coef == "gini" ? ffapl_coef_gini :
         p.ffapl.coef == "lts" ? ffapl_coef_lts :
         (abort(), nullptr);
 
+    double const k = step_coef(p, p.ffapl.taum);
     double dVdt;
-    for (unsigned t = 1; t < p.time.steps_all(); t++) {
+    for (unsigned t = t0+1; t < t1; t++) {
         coef_t(t) = coef_calc(p, pn_t.col(t-1), pn_spont);
         dVdt = -ffapl_t(t-1) + p.ffapl.w*coef_t(t)*pn_t.col(t-1).sum();
-        ffapl_t(t) = ffapl_t(t-1) + dVdt*p.time.dt/p.ffapl.taum;
+        ffapl_t(t) = ffapl_t(t-1) + dVdt*k;
     }
+}
+FFAPLPrefix::FFAPLPrefix(ModelParams const& p, Column const& pn_spont,
+        Matrix const& pn_t, unsigned last) {
+    vm = Row::Zero(1, last+1);
+    coef = Row::Zero(1, last+1);
+    integrate_FFAPL(p, pn_spont, pn_t, vm, coef, 0, last+1);
+}
+bool same_prefix(Matrix const& a, Matrix const& b, unsigned n) {
+    /* (Leading columns are contiguous.) */
+    return a.rows() == b.rows() && a.cols() >= n && b.cols() >= n
+        && std::memcmp(a.data(), b.data(), sizeof(double)*a.rows()*n) == 0;
+}
+unsigned kc_features(ModelParams const& p, RunVars::KC const& kc,
+        bool ffapl_nonzero, KCRecording const& rec) {
+    bool record_apl = rec.inh || rec.Is;
+    bool record = rec.Vm || rec.spikes || rec.nves || record_apl;
+    /* APL feedback does nothing if no KC can drive the APL, or if the APL
+     * cannot reach any KC (unless its timecourse is wanted anyway). */
+    bool apl = !kc.wKCAPL.isZero(0.0)
+        && (record_apl || !kc.wAPLKC.isZero(0.0));
+    return (p.kc.ves_p != 0.0 ? KC_DEPRESSION : 0)
+        | (!p.kc.ignore_ffapl && ffapl_nonzero ? KC_FFAPL : 0)
+        | (apl ? KC_APL : 0)
+        | (record ? KC_RECORD : 0);
+}
 
-    double spont = ffapl_t(p.time.stim.start_step()-1);
-    if (p.ffapl.nneg) {
-        ffapl_t = (spont < ffapl_t.array()).select(ffapl_t, spont);
+template<class T>
+KCVesicles<T>::KCVesicles(ModelParams const& p) :
+        k_r(step_coef(p, p.kc.tau_r)), ves_p(p.kc.ves_p),
+        recovery(p.time.steps_all()+1) {
+    T const decay = T(1.0) - k_r;
+    recovery[0] = 1.0;
+    for (unsigned k = 1; k < recovery.size(); k++) {
+        recovery[k] = recovery[k-1]*decay;
     }
-    if (p.ffapl.zero) {
-        ffapl_t = ffapl_t.array() - spont;
+}
+template<class T>
+inline T KCVesicles<T>::at(T n, int last, unsigned t) const {
+    /* A pool that has never been depleted stays full. */
+    if (last < 0) return n;
+    unsigned k = t - last;
+    if (k == 0) return n;
+    /* The step after a spike depletes as well as recovers. */
+    n += k_r*(T(1.0)-n) - ves_p*n;
+    return k == 1 ? n : T(1.0) - (T(1.0)-n)*recovery[k-1];
+}
+
+/* Scalar KC step, starting at KC begin (used for the SIMD tails). */
+template<class T>
+inline void kc_step_from(KCStep<T> const& s, unsigned begin,
+        std::vector<unsigned>& fired) {
+    for (unsigned i = begin; i < s.n; i++) {
+        T dKCdt = -s.Vm[i] + s.in[i];
+        dKCdt -= s.wAPLKC[i]*s.inh;
+        dKCdt -= s.ffapl;
+        T Vm = s.Vm[i] + dKCdt*s.k;
+        if (Vm > s.thr[i]) {
+            Vm = 0.0; // very abrupt repolarization!
+            fired.push_back(i);
+        }
+        s.Vm[i] = Vm;
+        s.peak[i] = std::max(s.peak[i], Vm);
+    }
+}
+template<class T>
+void kc_step_scalar(KCStep<T> const& s, std::vector<unsigned>& fired) {
+    kc_step_from(s, 0, fired);
+}
+
+#ifdef OLFSYSM_X86_DISPATCH
+__attribute__((target("avx2")))
+void kc_step_avx2(KCStep<double> const& s, std::vector<unsigned>& fired) {
+    __m256d const inh   = _mm256_set1_pd(s.inh);
+    __m256d const ffapl = _mm256_set1_pd(s.ffapl);
+    __m256d const k     = _mm256_set1_pd(s.k);
+    __m256d const zero  = _mm256_setzero_pd();
+    unsigned i = 0;
+    for (; i+4 <= s.n; i += 4) {
+        __m256d Vm = _mm256_loadu_pd(s.Vm+i);
+        __m256d d = _mm256_add_pd(_mm256_sub_pd(zero, Vm),
+                _mm256_loadu_pd(s.in+i));
+        d = _mm256_sub_pd(d, _mm256_mul_pd(_mm256_loadu_pd(s.wAPLKC+i), inh));
+        d = _mm256_sub_pd(d, ffapl);
+        Vm = _mm256_add_pd(Vm, _mm256_mul_pd(d, k));
+        __m256d spk = _mm256_cmp_pd(Vm, _mm256_loadu_pd(s.thr+i), _CMP_GT_OQ);
+        Vm = _mm256_andnot_pd(spk, Vm);
+        _mm256_storeu_pd(s.Vm+i, Vm);
+        _mm256_storeu_pd(s.peak+i,
+                _mm256_max_pd(_mm256_loadu_pd(s.peak+i), Vm));
+        for (int m = _mm256_movemask_pd(spk); m; m &= m-1) {
+            fired.push_back(i + __builtin_ctz(m));
+        }
+    }
+    kc_step_from(s, i, fired);
+}
+__attribute__((target("avx2")))
+void kc_step_avx2(KCStep<float> const& s, std::vector<unsigned>& fired) {
+    __m256 const inh   = _mm256_set1_ps(s.inh);
+    __m256 const ffapl = _mm256_set1_ps(s.ffapl);
+    __m256 const k     = _mm256_set1_ps(s.k);
+    __m256 const zero  = _mm256_setzero_ps();
+    unsigned i = 0;
+    for (; i+8 <= s.n; i += 8) {
+        __m256 Vm = _mm256_loadu_ps(s.Vm+i);
+        __m256 d = _mm256_add_ps(_mm256_sub_ps(zero, Vm),
+                _mm256_loadu_ps(s.in+i));
+        d = _mm256_sub_ps(d, _mm256_mul_ps(_mm256_loadu_ps(s.wAPLKC+i), inh));
+        d = _mm256_sub_ps(d, ffapl);
+        Vm = _mm256_add_ps(Vm, _mm256_mul_ps(d, k));
+        __m256 spk = _mm256_cmp_ps(Vm, _mm256_loadu_ps(s.thr+i), _CMP_GT_OQ);
+        Vm = _mm256_andnot_ps(spk, Vm);
+        _mm256_storeu_ps(s.Vm+i, Vm);
+        _mm256_storeu_ps(s.peak+i,
+                _mm256_max_ps(_mm256_loadu_ps(s.peak+i), Vm));
+        for (int m = _mm256_movemask_ps(spk); m; m &= m-1) {
+            fired.push_back(i + __builtin_ctz(m));
+        }
+    }
+    kc_step_from(s, i, fired);
+}
+__attribute__((target("avx512f")))
+void kc_step_avx512(KCStep<double> const& s, std::vector<unsigned>& fired) {
+    __m512d const inh   = _mm512_set1_pd(s.inh);
+    __m512d const ffapl = _mm512_set1_pd(s.ffapl);
+    __m512d const k     = _mm512_set1_pd(s.k);
+    __m512d const zero  = _mm512_setzero_pd();
+    unsigned i = 0;
+    for (; i+8 <= s.n; i += 8) {
+        __m512d Vm = _mm512_loadu_pd(s.Vm+i);
+        __m512d d = _mm512_add_pd(_mm512_sub_pd(zero, Vm),
+                _mm512_loadu_pd(s.in+i));
+        d = _mm512_sub_pd(d, _mm512_mul_pd(_mm512_loadu_pd(s.wAPLKC+i), inh));
+        d = _mm512_sub_pd(d, ffapl);
+        Vm = _mm512_add_pd(Vm, _mm512_mul_pd(d, k));
+        __mmask8 spk = _mm512_cmp_pd_mask(Vm, _mm512_loadu_pd(s.thr+i),
+                _CMP_GT_OQ);
+        Vm = _mm512_mask_mov_pd(Vm, spk, zero);
+        _mm512_storeu_pd(s.Vm+i, Vm);
+        _mm512_storeu_pd(s.peak+i,
+                _mm512_max_pd(_mm512_loadu_pd(s.peak+i), Vm));
+        for (unsigned m = spk; m; m &= m-1) {
+            fired.push_back(i + __builtin_ctz(m));
+        }
+    }
+    kc_step_from(s, i, fired);
+}
+__attribute__((target("avx512f")))
+void kc_step_avx512(KCStep<float> const& s, std::vector<unsigned>& fired) {
+    __m512 const inh   = _mm512_set1_ps(s.inh);
+    __m512 const ffapl = _mm512_set1_ps(s.ffapl);
+    __m512 const k     = _mm512_set1_ps(s.k);
+    __m512 const zero  = _mm512_setzero_ps();
+    unsigned i = 0;
+    for (; i+16 <= s.n; i += 16) {
+        __m512 Vm = _mm512_loadu_ps(s.Vm+i);
+        __m512 d = _mm512_add_ps(_mm512_sub_ps(zero, Vm),
+                _mm512_loadu_ps(s.in+i));
+        d = _mm512_sub_ps(d, _mm512_mul_ps(_mm512_loadu_ps(s.wAPLKC+i), inh));
+        d = _mm512_sub_ps(d, ffapl);
+        Vm = _mm512_add_ps(Vm, _mm512_mul_ps(d, k));
+        __mmask16 spk = _mm512_cmp_ps_mask(Vm, _mm512_loadu_ps(s.thr+i),
+                _CMP_GT_OQ);
+        Vm = _mm512_mask_mov_ps(Vm, spk, zero);
+        _mm512_storeu_ps(s.Vm+i, Vm);
+        _mm512_storeu_ps(s.peak+i,
+                _mm512_max_ps(_mm512_loadu_ps(s.peak+i), Vm));
+        for (unsigned m = spk; m; m &= m-1) {
+            fired.push_back(i + __builtin_ctz(m));
+        }
+    }
+    kc_step_from(s, i, fired);
+}
+#endif
+
+template<class T>
+KCStepKernel<T> kc_step_kernel() {
+#ifdef OLFSYSM_X86_DISPATCH
+    if (__builtin_cpu_supports("avx512f")) return kc_step_avx512;
+    if (__builtin_cpu_supports("avx2"))    return kc_step_avx2;
+#endif
+    return kc_step_scalar<T>;
+}
+
+template<class T>
+void kc_lanes_scalar(KCLanesStep<T> const& s, std::vector<unsigned>& fired) {
+    for (unsigned kc = 0; kc < s.n; kc++) {
+        unsigned const* g = s.gloms + std::size_t(kc)*s.nc;
+        T const* w = s.claw_w + std::size_t(kc)*s.nc;
+        std::size_t const o = std::size_t(kc)*s.lanes;
+        bool any = false;
+        for (unsigned b = 0; b < s.lanes; b++) {
+            T in = 0.0;
+            for (unsigned c = 0; c < s.nc; c++) {
+                in += w[c]*s.pn[std::size_t(g[c])*s.lanes + b];
+            }
+            T dKCdt = -s.Vm[o+b] + in;
+            dKCdt -= s.wAPLKC[kc]*s.inh[b];
+            dKCdt -= s.ffapl[b];
+            T Vm = s.Vm[o+b] + dKCdt*s.k;
+            T spike = 0.0;
+            if (Vm > s.thr[kc]) {
+                Vm = 0.0;
+                spike = 1.0;
+                any = true;
+            }
+            s.Vm[o+b] = Vm;
+            s.spikes[o+b] = spike;
+            s.counts[o+b] += spike;
+            s.peak[o+b] = std::max(s.peak[o+b], Vm);
+        }
+        if (any) fired.push_back(kc);
+    }
+}
+
+#ifdef OLFSYSM_X86_DISPATCH
+/* As in the fused steps, products and sums are kept separate so that they
+ * contract (or not) exactly as the scalar code does. */
+__attribute__((target("avx2")))
+void kc_lanes_avx2(KCLanesStep<double> const& s, std::vector<unsigned>& fired) {
+    __m256d const k    = _mm256_set1_pd(s.k);
+    __m256d const zero = _mm256_setzero_pd();
+    __m256d const one  = _mm256_set1_pd(1.0);
+    for (unsigned kc = 0; kc < s.n; kc++) {
+        unsigned const* g = s.gloms + std::size_t(kc)*s.nc;
+        double const* w = s.claw_w + std::size_t(kc)*s.nc;
+        std::size_t const o = std::size_t(kc)*s.lanes;
+        __m256d const wAPLKC = _mm256_set1_pd(s.wAPLKC[kc]);
+        __m256d const thr    = _mm256_set1_pd(s.thr[kc]);
+        int any = 0;
+        for (unsigned b = 0; b < s.lanes; b += 4) {
+            __m256d in = zero;
+            for (unsigned c = 0; c < s.nc; c++) {
+                in = _mm256_add_pd(in, _mm256_mul_pd(_mm256_set1_pd(w[c]),
+                        _mm256_loadu_pd(s.pn + std::size_t(g[c])*s.lanes + b)));
+            }
+            __m256d Vm = _mm256_loadu_pd(s.Vm+o+b);
+            __m256d d = _mm256_add_pd(_mm256_sub_pd(zero, Vm), in);
+            d = _mm256_sub_pd(d,
+                    _mm256_mul_pd(wAPLKC, _mm256_loadu_pd(s.inh+b)));
+            d = _mm256_sub_pd(d, _mm256_loadu_pd(s.ffapl+b));
+            Vm = _mm256_add_pd(Vm, _mm256_mul_pd(d, k));
+            __m256d spk = _mm256_cmp_pd(Vm, thr, _CMP_GT_OQ);
+            Vm = _mm256_andnot_pd(spk, Vm);
+            __m256d spike = _mm256_and_pd(spk, one);
+            _mm256_storeu_pd(s.Vm+o+b, Vm);
+            _mm256_storeu_pd(s.spikes+o+b, spike);
+            _mm256_storeu_pd(s.counts+o+b,
+                    _mm256_add_pd(_mm256_loadu_pd(s.counts+o+b), spike));
+            _mm256_storeu_pd(s.peak+o+b,
+                    _mm256_max_pd(_mm256_loadu_pd(s.peak+o+b), Vm));
+            any |= _mm256_movemask_pd(spk);
+        }
+        if (any) fired.push_back(kc);
+    }
+}
+__attribute__((target("avx2")))
+void kc_lanes_avx2(KCLanesStep<float> const& s, std::vector<unsigned>& fired) {
+    __m256 const k    = _mm256_set1_ps(s.k);
+    __m256 const zero = _mm256_setzero_ps();
+    __m256 const one  = _mm256_set1_ps(1.0f);
+    for (unsigned kc = 0; kc < s.n; kc++) {
+        unsigned const* g = s.gloms + std::size_t(kc)*s.nc;
+        float const* w = s.claw_w + std::size_t(kc)*s.nc;
+        std::size_t const o = std::size_t(kc)*s.lanes;
+        __m256 const wAPLKC = _mm256_set1_ps(s.wAPLKC[kc]);
+        __m256 const thr    = _mm256_set1_ps(s.thr[kc]);
+        int any = 0;
+        for (unsigned b = 0; b < s.lanes; b += 8) {
+            __m256 in = zero;
+            for (unsigned c = 0; c < s.nc; c++) {
+                in = _mm256_add_ps(in, _mm256_mul_ps(_mm256_set1_ps(w[c]),
+                        _mm256_loadu_ps(s.pn + std::size_t(g[c])*s.lanes + b)));
+            }
+            __m256 Vm = _mm256_loadu_ps(s.Vm+o+b);
+            __m256 d = _mm256_add_ps(_mm256_sub_ps(zero, Vm), in);
+            d = _mm256_sub_ps(d,
+                    _mm256_mul_ps(wAPLKC, _mm256_loadu_ps(s.inh+b)));
+            d = _mm256_sub_ps(d, _mm256_loadu_ps(s.ffapl+b));
+            Vm = _mm256_add_ps(Vm, _mm256_mul_ps(d, k));
+            __m256 spk = _mm256_cmp_ps(Vm, thr, _CMP_GT_OQ);
+            Vm = _mm256_andnot_ps(spk, Vm);
+            __m256 spike = _mm256_and_ps(spk, one);
+            _mm256_storeu_ps(s.Vm+o+b, Vm);
+            _mm256_storeu_ps(s.spikes+o+b, spike);
+            _mm256_storeu_ps(s.counts+o+b,
+                    _mm256_add_ps(_mm256_loadu_ps(s.counts+o+b), spike));
+            _mm256_storeu_ps(s.peak+o+b,
+                    _mm256_max_ps(_mm256_loadu_ps(s.peak+o+b), Vm));
+            any |= _mm256_movemask_ps(spk);
+        }
+        if (any) fired.push_back(kc);
+    }
+}
+__attribute__((target("avx512f")))
+void kc_lanes_avx512(KCLanesStep<double> const& s,
+        std::vector<unsigned>& fired) {
+    __m512d const k    = _mm512_set1_pd(s.k);
+    __m512d const zero = _mm512_setzero_pd();
+    __m512d const one  = _mm512_set1_pd(1.0);
+    for (unsigned kc = 0; kc < s.n; kc++) {
+        unsigned const* g = s.gloms + std::size_t(kc)*s.nc;
+        double const* w = s.claw_w + std::size_t(kc)*s.nc;
+        std::size_t const o = std::size_t(kc)*s.lanes;
+        __m512d const wAPLKC = _mm512_set1_pd(s.wAPLKC[kc]);
+        __m512d const thr    = _mm512_set1_pd(s.thr[kc]);
+        unsigned any = 0;
+        for (unsigned b = 0; b < s.lanes; b += 8) {
+            __m512d in = zero;
+            for (unsigned c = 0; c < s.nc; c++) {
+                in = _mm512_add_pd(in, _mm512_mul_pd(_mm512_set1_pd(w[c]),
+                        _mm512_loadu_pd(s.pn + std::size_t(g[c])*s.lanes + b)));
+            }
+            __m512d Vm = _mm512_loadu_pd(s.Vm+o+b);
+            __m512d d = _mm512_add_pd(_mm512_sub_pd(zero, Vm), in);
+            d = _mm512_sub_pd(d,
+                    _mm512_mul_pd(wAPLKC, _mm512_loadu_pd(s.inh+b)));
+            d = _mm512_sub_pd(d, _mm512_loadu_pd(s.ffapl+b));
+            Vm = _mm512_add_pd(Vm, _mm512_mul_pd(d, k));
+            __mmask8 spk = _mm512_cmp_pd_mask(Vm, thr, _CMP_GT_OQ);
+            Vm = _mm512_mask_mov_pd(Vm, spk, zero);
+            __m512d spike = _mm512_maskz_mov_pd(spk, one);
+            _mm512_storeu_pd(s.Vm+o+b, Vm);
+            _mm512_storeu_pd(s.spikes+o+b, spike);
+            _mm512_storeu_pd(s.counts+o+b,
+                    _mm512_add_pd(_mm512_loadu_pd(s.counts+o+b), spike));
+            _mm512_storeu_pd(s.peak+o+b,
+                    _mm512_max_pd(_mm512_loadu_pd(s.peak+o+b), Vm));
+            any |= spk;
+        }
+        if (any) fired.push_back(kc);
     }
 }
+__attribute__((target("avx512f")))
+void kc_lanes_avx512(KCLanesStep<float> const& s,
+        std::vector<unsigned>& fired) {
+    __m512 const k    = _mm512_set1_ps(s.k);
+    __m512 const zero = _mm512_setzero_ps();
+    __m512 const one  = _mm512_set1_ps(1.0f);
+    for (unsigned kc = 0; kc < s.n; kc++) {
+        unsigned const* g = s.gloms + std::size_t(kc)*s.nc;
+        float const* w = s.claw_w + std::size_t(kc)*s.nc;
+        std::size_t const o = std::size_t(kc)*s.lanes;
+        __m512 const wAPLKC = _mm512_set1_ps(s.wAPLKC[kc]);
+        __m512 const thr    = _mm512_set1_ps(s.thr[kc]);
+        unsigned any = 0;
+        for (unsigned b = 0; b < s.lanes; b += 16) {
+            __m512 in = zero;
+            for (unsigned c = 0; c < s.nc; c++) {
+                in = _mm512_add_ps(in, _mm512_mul_ps(_mm512_set1_ps(w[c]),
+                        _mm512_loadu_ps(s.pn + std::size_t(g[c])*s.lanes + b)));
+            }
+            __m512 Vm = _mm512_loadu_ps(s.Vm+o+b);
+            __m512 d = _mm512_add_ps(_mm512_sub_ps(zero, Vm), in);
+            d = _mm512_sub_ps(d,
+                    _mm512_mul_ps(wAPLKC, _mm512_loadu_ps(s.inh+b)));
+            d = _mm512_sub_ps(d, _mm512_loadu_ps(s.ffapl+b));
+            Vm = _mm512_add_ps(Vm, _mm512_mul_ps(d, k));
+            __mmask16 spk = _mm512_cmp_ps_mask(Vm, thr, _CMP_GT_OQ);
+            Vm = _mm512_mask_mov_ps(Vm, spk, zero);
+            __m512 spike = _mm512_maskz_mov_ps(spk, one);
+            _mm512_storeu_ps(s.Vm+o+b, Vm);
+            _mm512_storeu_ps(s.spikes+o+b, spike);
+            _mm512_storeu_ps(s.counts+o+b,
+                    _mm512_add_ps(_mm512_loadu_ps(s.counts+o+b), spike));
+            _mm512_storeu_ps(s.peak+o+b,
+                    _mm512_max_ps(_mm512_loadu_ps(s.peak+o+b), Vm));
+            any |= spk;
+        }
+        if (any) fired.push_back(kc);
+    }
+}
+#endif
+
+template<class T>
+KCLanesKernel<T> kc_lanes_kernel() {
+#ifdef OLFSYSM_X86_DISPATCH
+    if (__builtin_cpu_supports("avx512f")) return kc_lanes_avx512;
+    if (__builtin_cpu_supports("avx2"))    return kc_lanes_avx2;
+#endif
+    return kc_lanes_scalar<T>;
+}
+
+/* sim_KC_layer_stream, specialized on precision and kc_features(). */
+template<class T, unsigned F>
+void sim_KC_layer_stream_kernel(
+        ModelParams const& p, RunVars::KC const& kc,
+        Matrix const& pn_t, Vector const& ffapl_t,
+        std::vector<unsigned> const* kcs,
+        Column& spike_counts, Column& Vm_peak,
+        KCRecording const& rec) {
+    constexpr bool DEPRESSION = F & KC_DEPRESSION;
+    constexpr bool FFAPL      = F & KC_FFAPL;
+    constexpr bool APL        = F & KC_APL;
+    constexpr bool RECORD     = F & KC_RECORD;
+
+    using Vec = typename KCWeights<T>::Vec;
+
+    KCWeights<T> const w(kc, kcs);
+
+    unsigned const N = w.thr.size();
+    unsigned const t0 = p.time.start_step()+1;
+    T const k_Vm      = step_coef(p, p.kc.taum);
+    T const k_inh     = step_coef(p, p.kc.apl_taum);
+    T const k_Is      = step_coef(p, p.kc.tau_apl2kc);
+
+    /* Recorded timecourses hold the initial state before the KC window. */
+    if (RECORD) {
+        if (rec.Vm)     rec.Vm->leftCols(t0).setZero();
+        if (rec.spikes) rec.spikes->leftCols(t0).setZero();
+        if (rec.nves)   rec.nves->leftCols(t0).setOnes();
+        if (rec.inh)    rec.inh->leftCols(t0).setZero();
+        if (rec.Is)     rec.Is->leftCols(t0).setZero();
+    }
+
+    Vec Vm(N);     Vm.setZero();
+    Vec counts(N); counts.setZero();
+    Vec peak(N);   peak.setZero();
+    T inh = 0.0;
+    T Is  = 0.0;
+
+    /* Vesicle pools as of each KC's last spike (see KCVesicles). Without
+     * depression the vesicle factor stays at exactly 1. */
+    KCVesicles<T> const ves(p);
+    Vec nves(DEPRESSION ? N : 0); nves.setOnes();
+    std::vector<int> last_spike(DEPRESSION ? N : 0, -1);
+
+    /* The KCs that spiked on the previous step, and their summed (vesicle-
+     * weighted) output to the APL. */
+    std::vector<unsigned> fired;
+    fired.reserve(N);
+    T kc_out = 0.0;
+
+    auto record = [&](unsigned t) {
+        if (rec.Vm) rec.Vm->col(t) = Vm.template cast<double>();
+        if (rec.spikes) {
+            rec.spikes->col(t).setZero();
+            for (unsigned i : fired) (*rec.spikes)(i, t) = 1.0;
+        }
+        if (rec.nves) {
+            if (DEPRESSION) {
+                for (unsigned i = 0; i < N; i++) {
+                    (*rec.nves)(i, t) = ves.at(nves(i), last_spike[i], t);
+                }
+            }
+            else {
+                rec.nves->col(t).setOnes();
+            }
+        }
+        if (rec.inh)    (*rec.inh)(t) = inh;
+        if (rec.Is)     (*rec.Is)(t) = Is;
+    };
+
+    /* Quiescence is checked over windows of steps, against the state at the
+     * start of each window. */
+    unsigned const quiet_window = 16;
+    Quiescence quiescent(p, kc_settle_tau(p));
+    Vec Vm_then = Vm;
+    T inh_then = inh, Is_then = Is;
+    std::size_t spikes_then = 0;
+
+    static KCStepKernel<T> const step = kc_step_kernel<T>();
+    Vec pn(pn_t.rows());
+    Vec pn_in(N);
+    std::size_t n_spikes = 0;
+    unsigned t = t0;
+    for (; t < p.time.steps_all(); t++) {
+        T dIsdt = 0.0, dinhdt = 0.0;
+        if (APL) {
+            dIsdt  = -Is + kc_out*T(1e4);
+            dinhdt = -inh + Is;
+        }
+
+        pn = pn_t.col(t).cast<T>();
+        kc_claw_input(w, pn.data(), pn_in.data());
+        /* Integrate, threshold and reset, collecting the KCs that spiked. */
+        KCStep<T> const kc_step{
+            N, Vm.data(), pn_in.data(),
+            w.wAPLKC.data(), w.thr.data(), peak.data(),
+            APL ? inh : T(0.0),
+            FFAPL ? T(ffapl_t(t-1)) : T(0.0),
+            k_Vm};
+        fired.clear();
+        step(kc_step, fired);
+        if (APL) {
+            inh += dinhdt*k_inh;
+            Is  += dIsdt*k_Is;
+        }
+
+        /* Only the KCs that spiked deplete their vesicles or drive the APL. */
+        kc_out = 0.0;
+        for (unsigned i : fired) {
+            counts(i) += 1.0;
+            if (DEPRESSION) {
+                nves(i) = ves.at(nves(i), last_spike[i], t);
+                last_spike[i] = t;
+                if (APL) kc_out += w.wKCAPL(i)*nves(i);
+            }
+            else if (APL) {
+                kc_out += w.wKCAPL(i);
+            }
+        }
+
+        if (RECORD) {
+            record(t);
+        }
+
+        n_spikes += fired.size();
+        if (quiescent.enabled() && t >= quiescent.from
+                && (t-quiescent.from+1) % quiet_window == 0) {
+            double change = n_spikes != spikes_then
+                ? INFINITY
+                : std::max({
+                    N ? double((Vm-Vm_then).cwiseAbs().maxCoeff()) : 0.0,
+                    double(std::abs(inh-inh_then)),
+                    double(std::abs(Is-Is_then))})/quiet_window;
+            if (quiescent(t, change, quiet_window)) {
+                t++;
+                break;
+            }
+            Vm_then = Vm;
+            inh_then = inh;
+            Is_then = Is;
+            spikes_then = n_spikes;
+        }
+    }
+
+    /* After stopping early, Vm is held and the APL decays freely. */
+    if (RECORD) {
+        fired.clear();
+        for (; t < p.time.steps_all(); t++) {
+            if (APL) {
+                T dIsdt  = -Is;
+                T dinhdt = -inh + Is;
+                inh += dinhdt*k_inh;
+                Is  += dIsdt*k_Is;
+            }
+            record(t);
+        }
+    }
+
+    if (kcs) {
+        spike_counts.setZero(p.kc.N, 1);
+        Vm_peak.setZero(p.kc.N, 1);
+        for (unsigned i = 0; i < N; i++) {
+            spike_counts((*kcs)[i]) = counts(i);
+            Vm_peak((*kcs)[i]) = peak(i);
+        }
+        return;
+    }
+    spike_counts = counts.template cast<double>();
+    Vm_peak = peak.template cast<double>();
+}
+
+using KCStreamKernel = void (*)(
+        ModelParams const&, RunVars::KC const&,
+        Matrix const&, Vector const&,
+        std::vector<unsigned> const*,
+        Column&, Column&,
+        KCRecording const&);
+template<class T, std::size_t... F>
+std::array<KCStreamKernel, sizeof...(F)> kc_stream_kernels(
+        std::index_sequence<F...>) {
+    return {{&sim_KC_layer_stream_kernel<T, F>...}};
+}
+void sim_KC_layer_stream_kcs(
+        ModelParams const& p, RunVars::KC const& kc,
+        Matrix const& pn_t, Vector const& ffapl_t,
+        std::vector<unsigned> const* kcs,
+        Column& spike_counts, Column& Vm_peak,
+        KCRecording const& rec) {
+    static auto const kernels_d =
+        kc_stream_kernels<double>(std::make_index_sequence<16>());
+    static auto const kernels_f =
+        kc_stream_kernels<float>(std::make_index_sequence<16>());
+    unsigned f = kc_features(p, kc, !ffapl_t.isZero(0.0), rec);
+    (p.kc.single_precision ? kernels_f : kernels_d)[f](
+            p, kc, pn_t, ffapl_t, kcs, spike_counts, Vm_peak, rec);
+}
+void sim_KC_layer_stream(
+        ModelParams const& p, RunVars const& rv,
+        Matrix const& pn_t, Vector const& ffapl_t,
+        Column& spike_counts, Column& Vm_peak,
+        KCRecording const& rec) {
+    sim_KC_layer_stream_kcs(p, rv.kc, pn_t, ffapl_t, nullptr,
+            spike_counts, Vm_peak, rec);
+}
 void sim_KC_layer(
         ModelParams const& p, RunVars const& rv,
         Matrix const& pn_t, Vector const& ffapl_t,
         Matrix& Vm, Matrix& spikes, Matrix& nves, Row& inh, Row& Is) {
-    Vm.setZero();
-    spikes.setZero();
-    nves.setOnes();
-    inh.setZero();
-    Is.setZero();
-
-    float use_ffapl = float(!p.kc.ignore_ffapl);
+    Column spike_counts, Vm_peak;
+    KCRecording rec;
+    rec.Vm     = &Vm;
+    rec.spikes = &spikes;
+    rec.nves   = &nves;
+    rec.inh    = &inh;
+    rec.Is     = &Is;
+    sim_KC_layer_stream(p, rv, pn_t, ffapl_t, spike_counts, Vm_peak, rec);
+}
+/* sim_KC_layer_batch, specialized on precision and kc_features() (never
+ * recording). */
+template<class T, unsigned F>
+void sim_KC_layer_batch_kernel(
+        ModelParams const& p, UpstreamVars const& up, RunVars::KC const& kc,
+        std::vector<unsigned> const& odors,
+        std::vector<unsigned> const* kcs,
+        Matrix& spike_counts, Matrix& Vm_peaks) {
+    constexpr bool DEPRESSION = F & KC_DEPRESSION;
+    constexpr bool FFAPL      = F & KC_FFAPL;
+    constexpr bool APL        = F & KC_APL;
+
+    using Block = Eigen::Array<T, Eigen::Dynamic, Eigen::Dynamic>;
+    using Lanes = Eigen::Array<T, Eigen::Dynamic, 1>;
+
+    KCWeights<T> const w(kc, kcs);
+
+    /* Each odor is a lane (see KCLanesStep); the padding lanes get no input
+     * and are otherwise ignored. */
+    unsigned const B  = odors.size();
+    unsigned const L  = KCLanesStep<T>::align;
+    unsigned const BP = (B+L-1)/L*L;
+    unsigned const N  = w.thr.size();
+    T const k_Vm      = step_coef(p, p.kc.taum);
+    T const k_inh     = step_coef(p, p.kc.apl_taum);
+    T const k_Is      = step_coef(p, p.kc.tau_apl2kc);
+
+    KCVesicles<T> const ves(p);
+
+    Block Vm(BP, N);      Vm.setZero();
+    Block spikes(BP, N);  spikes.setZero();
+    /* Vesicle pools as of each KC's last spike (see KCVesicles). */
+    Block nves(B, DEPRESSION ? N : 0); nves.setOnes();
+    Eigen::ArrayXXi last_spike(B, DEPRESSION ? N : 0); last_spike.setConstant(-1);
+    Block counts(BP, N);  counts.setZero();
+    Block peaks(BP, N);   peaks.setZero();
+    Block pn(BP, get_ngloms(p)); pn.setZero();
+    Lanes inh(BP);    inh.setZero();
+    Lanes Is(BP);     Is.setZero();
+    Lanes apl_in(BP); apl_in.setZero();
+    Lanes ffapl(BP);  ffapl.setZero();
+    Lanes dIsdt(BP);
+    Lanes dinhdt(BP);
+
+    static KCLanesKernel<T> const step = kc_lanes_kernel<T>();
+    KCLanesStep<T> const kc_step{
+        N, BP, w.n_claws, w.gloms, w.claw_w.data(), pn.data(),
+        Vm.data(), spikes.data(), counts.data(), peaks.data(),
+        w.wAPLKC.data(), w.thr.data(), inh.data(), ffapl.data(),
+        k_Vm};
+    /* The KCs that spiked (in any odor) on the last step. */
+    std::vector<unsigned> fired;
+    fired.reserve(N);
+
+    /* Quiescence is checked over windows of steps, against the state at the
+     * start of each window, and only ends the batch once every odor is
+     * quiescent. */
+    unsigned const quiet_window = 16;
+    Quiescence quiescent(p, kc_settle_tau(p));
+    Block Vm_then = Vm.topRows(B);
+    Lanes inh_then = inh.head(B), Is_then = Is.head(B);
+    double spikes_then = 0.0;
 
-    Column dKCdt;
     for (unsigned t = p.time.start_step()+1; t < p.time.steps_all(); t++) {
-        double dIsdt = -Is(t-1) + (
-                rv.kc.wKCAPL*(nves.col(t-1).array()*spikes.col(t-1).array()).matrix())(0,0)*1e4;
-        double dinhdt = -inh(t-1) + Is(t-1);
+        /* The APL is updated lane by lane, exactly as in the streaming
+         * kernel. */
+        for (unsigned b = 0; b < B && APL; b++) {
+            dIsdt(b)  = -Is(b) + apl_in(b)*T(1e4);
+            dinhdt(b) = -inh(b) + Is(b);
+            apl_in(b) = 0.0;
+        }
+        for (unsigned b = 0; b < B; b++) {
+            pn.row(b) = up.pn.sims[odors[b]].col(t).transpose().array()
+                .template cast<T>();
+            if (FFAPL) {
+                ffapl(b) = up.ffapl.vm_sims[odors[b]](t-1);
+            }
+        }
 
-        dKCdt =
-            (-Vm.col(t-1)
-            +rv.kc.wPNKC*pn_t.col(t)
-            -rv.kc.wAPLKC*inh(t-1)).array()
-            -use_ffapl*ffapl_t(t-1);
-        Vm.col(t) = Vm.col(t-1) + dKCdt*p.time.dt/p.kc.taum;
-        inh(t)    = inh(t-1)    + dinhdt*p.time.dt/p.kc.apl_taum;
-        Is(t)     = Is(t-1)     + dIsdt*p.time.dt/p.kc.tau_apl2kc;
+        fired.clear();
+        step(kc_step, fired);
+
+        /* Only the odors in which a KC spiked deplete its vesicles or drive
+         * the APL. */
+        for (unsigned kc : fired) {
+            for (unsigned b = 0; b < B; b++) {
+                if (spikes(b, kc) == T(0.0)) continue;
+                if (DEPRESSION) {
+                    nves(b, kc) = ves.at(nves(b, kc), last_spike(b, kc), t);
+                    last_spike(b, kc) = t;
+                    if (APL) apl_in(b) += w.wKCAPL(kc)*nves(b, kc);
+                }
+                else if (APL) {
+                    apl_in(b) += w.wKCAPL(kc);
+                }
+            }
+        }
 
-        nves.col(t) = nves.col(t-1);
-        nves.col(t) += p.time.dt*((1.0-nves.col(t-1).array()).matrix()/p.kc.tau_r) - (p.kc.ves_p*spikes.col(t-1).array()*nves.col(t-1).array()).matrix();
+        for (unsigned b = 0; b < B && APL; b++) {
+            inh(b) += dinhdt(b)*k_inh;
+            Is(b)  += dIsdt(b)*k_Is;
+        }
 
-        auto const thr_comp = Vm.col(t).array() > rv.kc.thr.array();
-        spikes.col(t) = thr_comp.select(1.0, spikes.col(t)); // either go to 1 or _stay_ at 0.
-        Vm.col(t) = thr_comp.select(0.0, Vm.col(t)); // very abrupt repolarization!
+        if (quiescent.enabled() && t >= quiescent.from
+                && (t-quiescent.from+1) % quiet_window == 0) {
+            double n_spikes =
+                counts.topRows(B).template cast<double>().sum();
+            double change = n_spikes != spikes_then
+                ? INFINITY
+                : std::max({
+                    N ? double((Vm.topRows(B)-Vm_then).abs().maxCoeff())
+                      : 0.0,
+                    double((inh.head(B)-inh_then).abs().maxCoeff()),
+                    double((Is.head(B)-Is_then).abs().maxCoeff())})
+                  /quiet_window;
+            if (quiescent(t, change, quiet_window)) {
+                break;
+            }
+            Vm_then = Vm.topRows(B);
+            inh_then = inh.head(B);
+            Is_then = Is.head(B);
+            spikes_then = n_spikes;
+        }
     }
+
+    if (kcs) {
+        spike_counts.setZero(p.kc.N, B);
+        Vm_peaks.setZero(p.kc.N, B);
+        for (unsigned i = 0; i < N; i++) {
+            spike_counts.row((*kcs)[i]) =
+                counts.col(i).head(B).transpose().template cast<double>();
+            Vm_peaks.row((*kcs)[i]) =
+                peaks.col(i).head(B).transpose().template cast<double>();
+        }
+        return;
+    }
+    spike_counts =
+        counts.topRows(B).matrix().transpose().template cast<double>();
+    Vm_peaks =
+        peaks.topRows(B).matrix().transpose().template cast<double>();
+}
+
+using KCBatchKernel = void (*)(
+        ModelParams const&, UpstreamVars const&, RunVars::KC const&,
+        std::vector<unsigned> const&,
+        std::vector<unsigned> const*,
+        Matrix&, Matrix&);
+template<class T, std::size_t... F>
+std::array<KCBatchKernel, sizeof...(F)> kc_batch_kernels(
+        std::index_sequence<F...>) {
+    return {{&sim_KC_layer_batch_kernel<T, F>...}};
+}
+void sim_KC_layer_batch_kcs(
+        ModelParams const& p, UpstreamVars const& up, RunVars::KC const& kc,
+        std::vector<unsigned> const& odors,
+        std::vector<unsigned> const* kcs,
+        Matrix& spike_counts, Matrix& Vm_peaks) {
+    static auto const kernels_d =
+        kc_batch_kernels<double>(std::make_index_sequence<8>());
+    static auto const kernels_f =
+        kc_batch_kernels<float>(std::make_index_sequence<8>());
+    bool ffapl_nonzero = false;
+    for (unsigned i : odors) {
+        ffapl_nonzero = ffapl_nonzero || !up.ffapl.vm_sims[i].isZero(0.0);
+    }
+    unsigned f = kc_features(p, kc, ffapl_nonzero, KCRecording());
+    (p.kc.single_precision ? kernels_f : kernels_d)[f](
+            p, up, kc, odors, kcs, spike_counts, Vm_peaks);
+}
+void sim_KC_layer_batch(
+        ModelParams const& p, RunVars const& rv,
+        std::vector<unsigned> const& odors,
+        Matrix& spike_counts, Matrix& Vm_peaks) {
+    sim_KC_layer_batch_kcs(p, rv, rv.kc, odors, nullptr,
+            spike_counts, Vm_peaks);
 }
 
 void run_ORN_LN_sims(ModelParams const& p, RunVars& rv) {
-    rv.log("running ORN and LN sims");
+    run_ORN_LN_sims(p, rv, rv.log);
+}
+void run_ORN_LN_sims(ModelParams const& p, UpstreamVars& up, Logger& log) {
+    log("running ORN and LN sims");
     std::vector<unsigned> simlist = get_simlist(p);
-#pragma omp parallel
-    {
-        Matrix orn_t(get_ngloms(p), p.time.steps_all());
-        Row inhA(1, p.time.steps_all());
-        Row inhB(1, p.time.steps_all());
-#pragma omp for
-        for (unsigned j = 0; j < simlist.size(); j++) {
-            unsigned i = simlist[j];
-            sim_ORN_layer(p, rv, i, orn_t);
-            sim_LN_layer(p, orn_t, inhA, inhB);
-#pragma omp critical
-            {
-                rv.orn.sims[i] = orn_t;
-                rv.ln.inhA.sims[i] = inhA;
-                rv.ln.inhB.sims[i] = inhB;
+    unsigned const steps = p.time.steps_all();
+    /* Every odor's ORN traces come from the same stimulus response, so
+     * their means (all the LNs see) do too. */
+    ORNStimResponse const stim(p);
+    double const spont_mean = p.orn.data.spont.mean();
+    /* The LNs are the same for every odor until the stimulus. */
+    unsigned const shared = shared_prefix_steps(p);
+    std::unique_ptr<LNPrefix const> prefix;
+    if (shared > 0) prefix.reset(new LNPrefix(p, shared));
+    /* Each batch of odors only touches its own sims, so they are written in
+     * place. */
+    unsigned const nbatches = (simlist.size()+LN_BATCH-1)/LN_BATCH;
+#pragma omp parallel for schedule(dynamic)
+    for (unsigned k = 0; k < nbatches; k++) {
+        unsigned const j0 = k*LN_BATCH;
+        unsigned const B = std::min<std::size_t>(LN_BATCH, simlist.size()-j0);
+        Matrix orn_mean(B, steps);
+        for (unsigned b = 0; b < B; b++) {
+            unsigned i = simlist[j0+b];
+            unsigned const held =
+                sim_ORN_layer_from(p, stim, i, up.orn.sims[i]);
+            double const delta_mean = p.orn.data.delta.col(i).mean();
+            for (unsigned t = 0; t < steps; t++) {
+                orn_mean(b, t) = spont_mean
+                    + stim.response(std::min(t, held-1))*delta_mean;
             }
+        }
 
-            /*
-            sim_ORN_layer(p, rv, i, rv.orn.sims[i]);
-            sim_LN_layer(
-                    p, rv.orn.sims[i],
-                    rv.ln.inhA.sims[i], rv.ln.inhB.sims[i]);
-                    */
+        Matrix inhA, inhB;
+        sim_LN_layer_batch(p, orn_mean, inhA, inhB, prefix.get());
+        for (unsigned b = 0; b < B; b++) {
+            unsigned i = simlist[j0+b];
+            up.ln.inhA.sims[i] = inhA.row(b);
+            up.ln.inhB.sims[i] = inhB.row(b);
         }
     }
 }
 void run_PN_sims(ModelParams const& p, RunVars& rv) {
-    rv.log("running PN sims");
+    run_PN_sims(p, rv, rv.log);
+}
+void run_PN_sims(ModelParams const& p, UpstreamVars& up, Logger& log) {
+    log("running PN sims");
     std::vector<unsigned> simlist = get_simlist(p);
+    /* The stretch before the stimulus is simulated once, from the first
+     * odor's input. Every odor whose input matches that until the stimulus
+     * (as it does coming from run_ORN_LN_sims) is forked from its end. */
+    unsigned const shared = simlist.empty() ? 0 : shared_prefix_steps(p);
+    unsigned const first = shared > 0 ? simlist[0] : 0;
+    Matrix prefix;
+    if (shared > 0) {
+        sim_PN_layer_from(
+                p, first,
+                up.orn.sims[first].leftCols(shared+1),
+                up.ln.inhA.sims[first], up.ln.inhB.sims[first],
+                prefix, nullptr);
+    }
 #pragma omp parallel for
     for (unsigned j = 0; j < simlist.size(); j++) {
         unsigned i = simlist[j];
-        sim_PN_layer(
-                p, rv,
-                rv.orn.sims[i], rv.ln.inhA.sims[i], rv.ln.inhB.sims[i],
-                rv.pn.sims[i]);
+        bool fork = shared > 0
+            && same_prefix(up.orn.sims[i], up.orn.sims[first], shared)
+            && same_prefix(up.ln.inhA.sims[i], up.ln.inhA.sims[first], shared+1)
+            && same_prefix(up.ln.inhB.sims[i], up.ln.inhB.sims[first], shared+1);
+        sim_PN_layer_from(
+                p, i,
+                up.orn.sims[i], up.ln.inhA.sims[i], up.ln.inhB.sims[i],
+                up.pn.sims[i], fork ? &prefix : nullptr);
     }
 }
 void run_FFAPL_sims(ModelParams const& p, RunVars& rv) {
+    run_FFAPL_sims(p, rv, rv.log);
+}
+void run_FFAPL_sims(ModelParams const& p, UpstreamVars& up, Logger& log) {
+    log("running FFAPL sims");
     std::vector simlist = get_simlist(p);
+    /* The spontaneous PN rates, and (as in run_PN_sims) the raw prefix of
+     * every odor whose PNs match the first's until the stimulus, are only
+     * worked out once. */
+    Column const pn_spont = sample_PN_spont(p, up);
+    unsigned const shared = simlist.empty() ? 0 : shared_prefix_steps(p);
+    unsigned const first = shared > 0 ? simlist[0] : 0;
+    std::unique_ptr<FFAPLPrefix const> prefix;
+    if (shared > 0) {
+        prefix.reset(new FFAPLPrefix(p, pn_spont, up.pn.sims[first], shared));
+    }
 #pragma omp parallel for
     for (unsigned j = 0; j < simlist.size(); j++) {
         unsigned i = simlist[j];
-        sim_FFAPL_layer(
-                p, rv,
-                rv.pn.sims[i],
-                rv.ffapl.vm_sims[i], rv.ffapl.coef_sims[i]);
+        bool fork = shared > 0
+            && same_prefix(up.pn.sims[i], up.pn.sims[first], shared);
+        sim_FFAPL_layer_from(
+                p, pn_spont,
+                up.pn.sims[i],
+                up.ffapl.vm_sims[i], up.ffapl.coef_sims[i],
+                fork ? prefix.get() : nullptr);
     }
 }
 void run_KC_sims(ModelParams const& p, RunVars& rv, bool regen) {
+    run_KC_sims_kc(p, rv, rv.kc, rv.log, regen);
+}
+void run_KC_sims(ModelParams const& p, KCRunVars& kv, bool regen) {
+    run_KC_sims_kc(p, *kv.upstream, kv.kc, kv.log, regen);
+}
+void run_KC_sims_kc(ModelParams const& p, UpstreamVars const& up,
+        RunVars::KC& kc, Logger& log, bool regen) {
     if (regen) {
-        rv.log("generating new KC replicate");
-        build_wPNKC(p, rv);
-        fit_sparseness(p, rv);
+        log("generating new KC replicate");
+        build_wPNKC_log(p, kc, log);
+        fit_sparseness_kcs(p, up, log, {&kc});
+    }
+    else {
+        /* wPNKC may have been edited since it was last built. */
+        sync_claws(kc);
     }
 
-    rv.log("running KC sims");
+    log("running KC sims");
     std::vector<unsigned> simlist = get_simlist(p);
-#pragma omp parallel
-    {
-        Matrix Vm_here;
-        if (!p.kc.save_vm_sims) {
-            Vm_here = Matrix(p.kc.N, p.time.steps_all());
-        }
 
-        Matrix spikes_here;
-        if (!p.kc.save_spike_recordings) {
-            spikes_here = Matrix(p.kc.N, p.time.steps_all());
+    /* Batching only applies if no timecourses are being saved. */
+    unsigned const batch =
+        (p.kc.save_vm_sims || p.kc.save_spike_recordings
+         || p.kc.save_nves_sims || p.kc.save_inh_sims || p.kc.save_Is_sims)
+        ? 1 : std::max(p.kc.odor_batch, 1u);
+    if (batch > 1) {
+#pragma omp parallel
+        {
+            Matrix counts, peaks;
+#pragma omp for schedule(dynamic)
+            for (unsigned j = 0; j < simlist.size(); j += batch) {
+                std::vector<unsigned> odors(
+                        simlist.begin()+j,
+                        simlist.begin()+std::min<std::size_t>(
+                            j+batch, simlist.size()));
+                sim_KC_layer_batch_kcs(p, up, kc, odors, nullptr,
+                        counts, peaks);
+                for (unsigned b = 0; b < odors.size(); b++) {
+                    kc.spike_counts.col(odors[b]) = counts.col(b);
+                    kc.responses.col(odors[b]) =
+                        (counts.col(b).array() > 0.0).select(1.0, counts.col(b));
+                }
+            }
         }
+        return;
+    }
 
-        Matrix nves_here;
-        if (!p.kc.save_nves_sims) {
-            nves_here = Matrix(p.kc.N, p.time.steps_all());
-        }
+#pragma omp parallel
+    {
+        Matrix respcol;
+        Column Vm_peak;
+#pragma omp for schedule(dynamic)
+        for (unsigned j = 0; j < simlist.size(); j++) {
+            unsigned i = simlist[j];
 
-        Row inh_here;
-        if (!p.kc.save_inh_sims) {
-            inh_here = Matrix(1, p.time.steps_all());
+            /* Only keep full timecourses of what was asked for. */
+            KCRecording rec;
+            if (p.kc.save_vm_sims)          rec.Vm     = &kc.vm_sims.at(i);
+            if (p.kc.save_spike_recordings) rec.spikes = &kc.spike_recordings.at(i);
+            if (p.kc.save_nves_sims)        rec.nves   = &kc.nves_sims.at(i);
+            if (p.kc.save_inh_sims)         rec.inh    = &kc.inh_sims.at(i);
+            if (p.kc.save_Is_sims)          rec.Is     = &kc.Is_sims.at(i);
+
+            sim_KC_layer_stream_kcs(
+                    p, kc,
+                    up.pn.sims[i], up.ffapl.vm_sims[i], nullptr,
+                    respcol, Vm_peak, rec);
+            kc.responses.col(i) =
+                (respcol.array() > 0.0).select(1.0, respcol);
+            kc.spike_counts.col(i) = respcol;
         }
+    }
+}
 
-        Row Is_here;
-        if (!p.kc.save_Is_sims) {
-            Is_here = Matrix(1, p.time.steps_all());
+void run_KC_replicates(ModelParams const& p, RunVars& rv, unsigned n,
+        KCReplicates& out) {
+    run_KC_replicates(p, rv, rv.log, n, out, rv.kc.wPNKC);
+}
+void run_KC_replicates(ModelParams const& p, KCRunVars& kv, unsigned n,
+        KCReplicates& out) {
+    run_KC_replicates(p, *kv.upstream, kv.log, n, out, kv.kc.wPNKC);
+}
+void run_KC_replicates(ModelParams const& p, UpstreamVars const& up,
+        Logger& log, unsigned n, KCReplicates& out, Matrix const& wPNKC) {
+    log(cat("generating ", n, " KC replicates"));
+
+    /* No timecourses are kept for the replicates. */
+    ModelParams pr = p;
+    pr.kc.save_vm_sims = false;
+    pr.kc.save_spike_recordings = false;
+    pr.kc.save_nves_sims = false;
+    pr.kc.save_inh_sims = false;
+    pr.kc.save_Is_sims = false;
+
+    std::vector<RunVars::KC> reps(n, RunVars::KC(pr));
+    std::vector<RunVars::KC*> kcs;
+    for (unsigned r = 0; r < n; r++) {
+        RunVars::KC& kc = reps[r];
+        /* The results go straight into out. */
+        kc.responses.resize(0, 0);
+        kc.spike_counts.resize(0, 0);
+        if (p.kc.preset_wPNKC) {
+            kc.wPNKC = wPNKC;
         }
+        build_wPNKC_kc(p, kc, r);
+        kcs.push_back(&kc);
+    }
+    fit_sparseness_kcs(pr, up, log, kcs);
+
+    unsigned const N = p.kc.N;
+    out.n = n;
+    out.wPNKC.resize(n*N, get_ngloms(p));
+    out.wAPLKC.resize(n*N, 1);
+    out.wKCAPL.resize(1, n*N);
+    out.spont_in.resize(n*N, 1);
+    out.thr.resize(n*N, 1);
+    out.responses.setZero(n*N, get_nodors(p));
+    out.spike_counts.setZero(n*N, get_nodors(p));
+    out.tuning_iters.resize(n);
+    for (unsigned r = 0; r < n; r++) {
+        RunVars::KC const& kc = reps[r];
+        out.wPNKC.middleRows(r*N, N) = kc.wPNKC;
+        out.wAPLKC.middleRows(r*N, N) = kc.wAPLKC;
+        out.wKCAPL.middleCols(r*N, N) = kc.wKCAPL;
+        out.spont_in.middleRows(r*N, N) = kc.spont_in;
+        out.thr.middleRows(r*N, N) = kc.thr;
+        out.tuning_iters[r] = kc.tuning_iters;
+    }
 
-        // Matrix Vm(p.kc.N, p.time.steps_all());
-        // Matrix spikes(p.kc.N, p.time.steps_all());
-        Matrix respcol;
-        Matrix respcol_bin;
-#pragma omp for
-        for (unsigned j = 0; j < simlist.size(); j++) {
-            unsigned i = simlist[j];
-            Matrix& Vm_link = p.kc.save_vm_sims
-                ? rv.kc.vm_sims.at(i)
-                : Vm_here;
-            Matrix& spikes_link = p.kc.save_spike_recordings
-                ? rv.kc.spike_recordings.at(i)
-                : spikes_here;
-            Matrix& nves_link = p.kc.save_nves_sims
-                ? rv.kc.nves_sims.at(i)
-                : nves_here;
-            Matrix& inh_link = p.kc.save_inh_sims
-                ? rv.kc.inh_sims.at(i)
-                : inh_here;
-            Matrix& Is_link = p.kc.save_Is_sims
-                ? rv.kc.Is_sims.at(i)
-                : Is_here;
-
-            sim_KC_layer(
-                    p, rv,
-                    rv.pn.sims[i], rv.ffapl.vm_sims[i],
-                    Vm_link, spikes_link, nves_link, inh_link, Is_link);
-            respcol = spikes_link.rowwise().sum();
-            respcol_bin = (respcol.array() > 0.0).select(1.0, respcol);
-
-#pragma omp critical
-            rv.kc.responses.col(i) = respcol_bin;
-            rv.kc.spike_counts.col(i) = respcol;
+    log(cat("running KC sims for ", n, " replicates"));
+    std::vector<unsigned> simlist = get_simlist(p);
+    unsigned const batch = std::max(p.kc.odor_batch, 1u);
+    unsigned const per_rep = (simlist.size()+batch-1)/batch;
+#pragma omp parallel
+    {
+        Matrix counts, peaks;
+#pragma omp for schedule(dynamic)
+        for (unsigned job = 0; job < n*per_rep; job++) {
+            unsigned r = job/per_rep;
+            unsigned j = (job%per_rep)*batch;
+            std::vector<unsigned> odors(
+                    simlist.begin()+j,
+                    simlist.begin()+std::min<std::size_t>(
+                        j+batch, simlist.size()));
+            if (batch > 1) {
+                sim_KC_layer_batch_kcs(pr, up, reps[r], odors, nullptr,
+                        counts, peaks);
+            }
+            else {
+                sim_KC_layer_stream_kcs(pr, reps[r],
+                        up.pn.sims[odors[0]], up.ffapl.vm_sims[odors[0]],
+                        nullptr, counts, peaks);
+            }
+            for (unsigned b = 0; b < odors.size(); b++) {
+                out.spike_counts.block(r*N, odors[b], N, 1) = counts.col(b);
+                out.responses.block(r*N, odors[b], N, 1) =
+                    (counts.col(b).array() > 0.0).select(1.0, counts.col(b));
+            }
         }
     }
 }
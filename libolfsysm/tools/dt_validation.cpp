@@ -0,0 +1,91 @@
+/* Agreement of coarser timesteps with the default integration.
+ *
+ * Runs the full pipeline on the Hallem data with forward Euler at
+ * dt = 0.5 ms as the reference, then with each integrator ("euler", "exp")
+ * at each timestep, re-tuning thresholds and APL weights every time. For
+ * each run it prints, against the reference KC x odor responses:
+ * - agree: the fraction of (KC, odor) entries with the same binary response;
+ * - jaccard: |both respond| / |either responds|;
+ * - count_corr: the correlation of the spike counts;
+ * and the wall time of the KC stage.
+ *
+ * Build with `make dt_validation` (in libolfsysm/), then:
+ *     ./bin/dt_validation [hc_data.csv] [dt_ms...]
+ * The timesteps default to 0.5, 1, 1.5, 2 and 2.5 ms. */
+
+#include "olfsysm.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+static double now() {
+    return std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Run every stage with the given integrator and timestep (in seconds); returns
+ * the KC stage's wall time. */
+static double run(ModelParams p, std::string const& integrator, double dt,
+        Matrix& responses, Matrix& spike_counts) {
+    p.time.integrator = integrator;
+    p.time.dt = dt;
+    clear_warm_starts();
+    RunVars rv(p);
+    rv.log.disable();
+    run_ORN_LN_sims(p, rv);
+    run_PN_sims(p, rv);
+    run_FFAPL_sims(p, rv);
+    double t0 = now();
+    run_KC_sims(p, rv, true);
+    double t1 = now();
+    responses = rv.kc.responses;
+    spike_counts = rv.kc.spike_counts;
+    return t1-t0;
+}
+
+static double correlation(Matrix const& a, Matrix const& b) {
+    double ma = a.mean(), mb = b.mean();
+    double sab = ((a.array()-ma)*(b.array()-mb)).sum();
+    double saa = (a.array()-ma).square().sum();
+    double sbb = (b.array()-mb).square().sum();
+    return sab/std::sqrt(saa*sbb);
+}
+
+int main(int argc, char** argv) {
+    std::string data = argc > 1 ? argv[1] : "../hc_data.csv";
+    std::vector<double> dts;
+    for (int i = 2; i < argc; i++) dts.push_back(std::atof(argv[i]));
+    if (dts.empty()) dts = {0.5, 1.0, 1.5, 2.0, 2.5};
+
+    ModelParams p = DEFAULT_PARAMS;
+    load_hc_data(p, data);
+    p.kc.seed = 12345;
+
+    Matrix ref_responses, ref_counts;
+    double ref_time = run(p, "euler", 0.5e-3, ref_responses, ref_counts);
+
+    std::printf("%7s %7s %8s %8s %10s %9s\n",
+            "dt_ms", "method", "agree", "jaccard", "count_corr", "kc_time");
+    std::printf("%7.2f %7s %8s %8s %10s %9.3f\n",
+            0.5, "euler", "ref", "ref", "ref", ref_time);
+    for (double dt_ms : dts) {
+        for (char const* integrator : {"euler", "exp"}) {
+            if (dt_ms == 0.5 && std::string(integrator) == "euler") continue;
+            Matrix responses, counts;
+            double t = run(p, integrator, dt_ms*1e-3, responses, counts);
+            double agree =
+                (responses.array() == ref_responses.array()).cast<double>().mean();
+            double both =
+                (responses.array()*ref_responses.array()).sum();
+            double either =
+                responses.sum() + ref_responses.sum() - both;
+            std::printf("%7.2f %7s %8.4f %8.3f %10.3f %9.3f\n",
+                    dt_ms, integrator, agree, both/either,
+                    correlation(counts, ref_counts), t);
+        }
+    }
+    return 0;
+}
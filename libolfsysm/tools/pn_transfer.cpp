@@ -0,0 +1,81 @@
+/* Speed and accuracy of the PN transfer functions.
+ *
+ * Runs the ORN/LN sims on the Hallem data once, then for each
+ * ModelParams::PN::transfer ("tanh", "rational", "table") prints:
+ * - pn_time: the best wall time of run_PN_sims over a few repeats;
+ * - max_dPN: the largest |difference| from the tanh PN sims;
+ * - kc_diff: how many (KC, odor) spike counts differ from the tanh run's,
+ *   after FFAPL and KC sims (same wPNKC, thresholds and APL weights re-tuned);
+ * - spikes: the total KC spike count;
+ * - thr_rel: the relative change of the summed KC thresholds.
+ *
+ * Build with `make pn_transfer` (in libolfsysm/), then:
+ *     ./bin/pn_transfer [hc_data.csv] [repeats]
+ * The repeats default to 5. */
+
+#include "olfsysm.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+static double now() {
+    return std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char** argv) {
+    std::string data = argc > 1 ? argv[1] : "../hc_data.csv";
+    int repeats = argc > 2 ? std::max(1, std::atoi(argv[2])) : 5;
+
+    ModelParams p = DEFAULT_PARAMS;
+    load_hc_data(p, data);
+    p.kc.seed = 12345;
+
+    Logger log;
+    UpstreamVars orn_ln(p);
+    run_ORN_LN_sims(p, orn_ln, log);
+
+    std::printf("%9s %9s %9s %8s %8s %9s\n",
+            "transfer", "pn_time", "max_dPN", "kc_diff", "spikes", "thr_rel");
+    std::shared_ptr<UpstreamVars> ref;
+    Matrix ref_counts;
+    double ref_thr = 0.0;
+    for (char const* transfer : {"tanh", "rational", "table"}) {
+        p.pn.transfer = transfer;
+        auto up = std::make_shared<UpstreamVars>(orn_ln);
+        double best = 0.0;
+        for (int r = 0; r < repeats; r++) {
+            double t0 = now();
+            run_PN_sims(p, *up, log);
+            double t1 = now();
+            if (r == 0 || t1-t0 < best) best = t1-t0;
+        }
+        run_FFAPL_sims(p, *up, log);
+
+        clear_warm_starts();
+        KCRunVars kv(p, up);
+        kv.log.disable();
+        run_KC_sims(p, kv, true);
+
+        if (!ref) {
+            ref = up;
+            ref_counts = kv.kc.spike_counts;
+            ref_thr = kv.kc.thr.sum();
+        }
+        double max_dpn = 0.0;
+        for (unsigned i = 0; i < up->pn.sims.size(); i++) {
+            max_dpn = std::max(max_dpn,
+                    (up->pn.sims[i]-ref->pn.sims[i]).cwiseAbs().maxCoeff());
+        }
+        long kc_diff =
+            (kv.kc.spike_counts.array() != ref_counts.array()).count();
+        std::printf("%9s %9.4f %9.2e %8ld %8.0f %9.2e\n",
+                transfer, best, max_dpn, kc_diff, kv.kc.spike_counts.sum(),
+                kv.kc.thr.sum()/ref_thr - 1.0);
+    }
+    return 0;
+}
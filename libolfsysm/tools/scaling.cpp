@@ -0,0 +1,69 @@
+/* Thread scaling of the simulation stages.
+ *
+ * Runs the full pipeline (ORN/LN, PN, FFAPL, then KC fitting and sims) on the
+ * Hallem data at each thread count, and prints the wall time of each stage,
+ * the speedup of the total over the first thread count, and whether the KC
+ * responses are bit-identical to that run's.
+ *
+ * Build with `make scaling` (in libolfsysm/), then:
+ *     ./bin/scaling [hc_data.csv] [threads...]
+ * The thread counts default to 1, 2, 4, ... up to omp_get_max_threads(). */
+
+#include "olfsysm.hpp"
+#include <omp.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+static double now() {
+    return std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char** argv) {
+    std::string data = argc > 1 ? argv[1] : "../hc_data.csv";
+    std::vector<int> threads;
+    for (int i = 2; i < argc; i++) threads.push_back(std::atoi(argv[i]));
+    if (threads.empty()) {
+        for (int t = 1; t < omp_get_max_threads(); t *= 2) {
+            threads.push_back(t);
+        }
+        threads.push_back(omp_get_max_threads());
+    }
+
+    ModelParams p = DEFAULT_PARAMS;
+    load_hc_data(p, data);
+    p.kc.seed = 12345;
+
+    std::printf("%7s %9s %9s %9s %9s %9s %8s %s\n",
+            "threads", "orn_ln", "pn", "ffapl", "kc", "total",
+            "speedup", "identical");
+    double total_1 = 0.0;
+    Matrix responses_1;
+    for (int t : threads) {
+        omp_set_num_threads(t);
+        RunVars rv(p);
+        rv.log.disable();
+
+        double t0 = now();
+        run_ORN_LN_sims(p, rv);
+        double t1 = now();
+        run_PN_sims(p, rv);
+        double t2 = now();
+        run_FFAPL_sims(p, rv);
+        double t3 = now();
+        run_KC_sims(p, rv, true);
+        double t4 = now();
+
+        if (responses_1.size() == 0) {
+            total_1 = t4-t0;
+            responses_1 = rv.kc.responses;
+        }
+        std::printf("%7d %9.3f %9.3f %9.3f %9.3f %9.3f %8.2f %s\n",
+                t, t1-t0, t2-t1, t3-t2, t4-t3, t4-t0, total_1/(t4-t0),
+                rv.kc.responses == responses_1 ? "yes" : "NO");
+    }
+    return 0;
+}